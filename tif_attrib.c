@@ -0,0 +1,356 @@
+//SPDX-License-Identifier: GPL-2.0-or-later
+/*
+ * Copyright (C) 2020 Intel Corporation
+ *
+ * Per-CPU interrupt, softirq and context switch counters
+ *
+ */
+
+#define _GNU_SOURCE
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <fcntl.h>
+#include <sched.h>
+#include "tif_attrib.h"
+
+#define PROC_INTERRUPTS "/proc/interrupts"
+#define PROC_SOFTIRQS "/proc/softirqs"
+#define ATTRIB_COL_WIDTH 11 //Counts are printed as " %10u"
+
+const char * const tif_attrib_names[ATTRIB_NUM] = {
+	[ATTRIB_IRQ] = "IRQ",
+	[ATTRIB_TIMER] = "LOC",
+	[ATTRIB_IPI] = "IPI",
+	[ATTRIB_NMI] = "NMI",
+	[ATTRIB_OTHER] = "OTHER",
+	[ATTRIB_SOFTIRQ + 0] = "HI",
+	[ATTRIB_SOFTIRQ + 1] = "TIMER",
+	[ATTRIB_SOFTIRQ + 2] = "NET_TX",
+	[ATTRIB_SOFTIRQ + 3] = "NET_RX",
+	[ATTRIB_SOFTIRQ + 4] = "BLOCK",
+	[ATTRIB_SOFTIRQ + 5] = "IRQ_POLL",
+	[ATTRIB_SOFTIRQ + 6] = "TASKLET",
+	[ATTRIB_SOFTIRQ + 7] = "SCHED",
+	[ATTRIB_SOFTIRQ + 8] = "HRTIMER",
+	[ATTRIB_SOFTIRQ + 9] = "RCU",
+	[ATTRIB_VCSW] = "VCSW",
+	[ATTRIB_IVCSW] = "IVCSW",
+};
+
+/*
+ * Open /proc file read whole with pread() on every snapshot. col maps
+ * CPU number to its column, -1 if the CPU is not listed. colon is the
+ * offset of ':' in the rows which is the same for all rows.
+ */
+struct proc_table {
+	const char *file;
+	int fd;
+	char *buf;
+	size_t size;
+	int *col;
+	int colon;
+};
+
+static struct proc_table interrupts = { PROC_INTERRUPTS, -1 };
+static struct proc_table softirqs = { PROC_SOFTIRQS, -1 };
+
+/*
+ * Reads the whole file into the table's buffer, growing it as needed
+ *
+ * Returns length read, -1 on error
+ */
+static ssize_t read_table(struct proc_table *t)
+{
+	ssize_t len = 0, r;
+	char *buf;
+
+	for (;;) {
+		if (len + 1 >= (ssize_t)t->size) {
+			buf = realloc(t->buf, t->size ? t->size * 2 : 16384);
+			if (!buf)
+				return -1;
+			t->buf = buf;
+			t->size = t->size ? t->size * 2 : 16384;
+		}
+
+		r = pread(t->fd, t->buf + len, t->size - len - 1, len);
+		if (r < 0)
+			return -1;
+		if (!r)
+			break;
+		len += r;
+	}
+
+	t->buf[len] = 0;
+
+	return len;
+}
+
+/*
+ * Opens the file and finds the column of every CPU from the header line
+ * and the offset of ':' from the first row
+ *
+ * Returns 0 on success, -1 on error
+ */
+static int open_table(struct proc_table *t)
+{
+	int ncpus = CPU_SETSIZE, idx = 0, cpu;
+	char *p, *nl;
+
+	t->fd = open(t->file, O_RDONLY);
+	if (t->fd < 0)
+		return -1;
+
+	t->col = malloc(ncpus * sizeof(int));
+	if (!t->col || read_table(t) <= 0)
+		return -1;
+
+	for (int i = 0; i < ncpus; i++)
+		t->col[i] = -1;
+
+	nl = strchr(t->buf, '\n');
+	if (!nl)
+		return -1;
+	*nl = 0;
+
+	for (p = strstr(t->buf, "CPU"); p; p = strstr(p + 3, "CPU")) {
+		cpu = atoi(p + 3);
+		if (cpu >= 0 && cpu < ncpus)
+			t->col[cpu] = idx;
+		idx++;
+	}
+
+	p = strchr(nl + 1, ':');
+	if (!p)
+		return -1;
+	t->colon = p - (nl + 1);
+
+	return 0;
+}
+
+static void close_table(struct proc_table *t)
+{
+	if (t->fd >= 0)
+		close(t->fd);
+	t->fd = -1;
+	free(t->buf);
+	t->buf = NULL;
+	t->size = 0;
+	free(t->col);
+	t->col = NULL;
+}
+
+/*
+ * Returns the count in column col of the row starting at line, which
+ * ends at end. The count is read at the cached offset. If the row is
+ * laid out differently, e.g. a count wider than the column, the row is
+ * split instead.
+ */
+static uint64_t row_count(const struct proc_table *t, char *line, char *end,
+		int col)
+{
+	char *p = line + t->colon + 1 + col * ATTRIB_COL_WIDTH;
+	char *e;
+	uint64_t v;
+
+	if (line[t->colon] == ':' && p + ATTRIB_COL_WIDTH <= end) {
+		v = strtoull(p, &e, 10);
+		if (e == p + ATTRIB_COL_WIDTH && (e == end || *e == ' '))
+			return v;
+	}
+
+	//Slow path
+	p = memchr(line, ':', end - line);
+	if (!p)
+		return 0;
+	p++;
+
+	for (int i = 0; ; i++) {
+		while (p < end && *p == ' ')
+			p++;
+		if (p >= end || !isdigit(*p))
+			return 0;
+		v = strtoull(p, &p, 10);
+		if (i == col)
+			return v;
+	}
+}
+
+/*
+ * Returns the source of an /proc/interrupts row by its name, -1 for
+ * rows that are not per CPU
+ */
+static int irq_src(const char *name)
+{
+	if (isdigit(*name))
+		return ATTRIB_IRQ;
+	if (!strncmp(name, "LOC:", 4))
+		return ATTRIB_TIMER;
+	if (!strncmp(name, "RES:", 4) || !strncmp(name, "CAL:", 4) ||
+			!strncmp(name, "TLB:", 4) || !strncmp(name, "IWI:", 4))
+		return ATTRIB_IPI;
+	if (!strncmp(name, "NMI:", 4) || !strncmp(name, "PMI:", 4))
+		return ATTRIB_NMI;
+	if (!strncmp(name, "ERR:", 4) || !strncmp(name, "MIS:", 4))
+		return -1;
+
+	return ATTRIB_OTHER;
+}
+
+/*
+ * Adds the counts of every row of the table to the snapshots of the
+ * CPUs. Rows of /proc/interrupts are counted by their source and rows of
+ * /proc/softirqs each in their own counter.
+ */
+static int snap_table(struct proc_table *t, const int *cpus, int num,
+		struct tif_attrib *snap, int is_irq)
+{
+	char *line, *end, *name;
+	int row = 0, src, col;
+
+	if (read_table(t) <= 0)
+		return -1;
+
+	//Skip header
+	line = strchr(t->buf, '\n');
+	for (; line && *++line; line = end, row++) {
+		end = strchr(line, '\n');
+		if (!end)
+			end = line + strlen(line);
+
+		name = line;
+		while (*name == ' ')
+			name++;
+
+		if (is_irq) {
+			src = irq_src(name);
+		} else {
+			if (row >= ATTRIB_SOFTIRQS)
+				break;
+			src = ATTRIB_SOFTIRQ + row;
+		}
+		if (src < 0)
+			continue;
+
+		for (int i = 0; i < num; i++) {
+			col = cpus[i] >= 0 && cpus[i] < CPU_SETSIZE ?
+				t->col[cpus[i]] : -1;
+			if (col >= 0)
+				snap[i].v[src] += row_count(t, line, end, col);
+		}
+
+		if (!*end)
+			break;
+	}
+
+	return 0;
+}
+
+/*
+ * Reads voluntary and involuntary context switches of a thread
+ */
+static void snap_ctxt(int tid, struct tif_attrib *snap)
+{
+	char file[64], buf[4096], *p;
+	ssize_t len;
+	int fd;
+
+	snprintf(file, sizeof(file), "/proc/self/task/%d/status", tid);
+	fd = open(file, O_RDONLY);
+	if (fd < 0)
+		return;
+
+	len = read(fd, buf, sizeof(buf) - 1);
+	close(fd);
+	if (len <= 0)
+		return;
+	buf[len] = 0;
+
+	p = strstr(buf, "\nvoluntary_ctxt_switches:");
+	if (p)
+		snap->v[ATTRIB_VCSW] = strtoull(strchr(p, ':') + 1, NULL, 10);
+
+	p = strstr(buf, "\nnonvoluntary_ctxt_switches:");
+	if (p)
+		snap->v[ATTRIB_IVCSW] = strtoull(strchr(p, ':') + 1, NULL, 10);
+}
+
+/*
+ * Opens /proc/interrupts and /proc/softirqs and caches their layout.
+ * CPUs brought online later are not counted.
+ *
+ * Returns 0 on success, -1 on error
+ */
+int tif_attrib_open(void)
+{
+	if (open_table(&interrupts) || open_table(&softirqs)) {
+		tif_attrib_close();
+		return -1;
+	}
+
+	return 0;
+}
+
+void tif_attrib_close(void)
+{
+	close_table(&interrupts);
+	close_table(&softirqs);
+}
+
+/*
+ * Takes a snapshot of the counters of each CPU and of the thread running
+ * in it. Makes system calls, so must be called from a non RT thread.
+ *
+ * Params:
+ * const int *cpus: CPUs
+ * const int *tids: kernel thread id of the thread in each CPU, 0 = none
+ * int num: number of CPUs
+ * struct tif_attrib *snap: num snapshots
+ *
+ * Returns 0 on success, -1 on error
+ */
+int tif_attrib_snap(const int *cpus, const int *tids, int num,
+		struct tif_attrib *snap)
+{
+	memset(snap, 0, num * sizeof(*snap));
+
+	if (snap_table(&interrupts, cpus, num, snap, 1) ||
+			snap_table(&softirqs, cpus, num, snap, 0))
+		return -1;
+
+	for (int i = 0; i < num; i++)
+		if (tids[i])
+			snap_ctxt(tids[i], &snap[i]);
+
+	return 0;
+}
+
+/*
+ * Sets d to the counts between two snapshots
+ */
+void tif_attrib_delta(struct tif_attrib *d, const struct tif_attrib *before,
+		const struct tif_attrib *after)
+{
+	for (int i = 0; i < ATTRIB_NUM; i++)
+		d->v[i] = after->v[i] >= before->v[i] ?
+			after->v[i] - before->v[i] : 0;
+}
+
+/*
+ * Prints the non zero counts as "NAME count" pairs, "none" if all are 0
+ */
+void tif_attrib_print(const struct tif_attrib *a, FILE *fp)
+{
+	int n = 0;
+
+	for (int i = 0; i < ATTRIB_NUM; i++)
+		if (a->v[i])
+			fprintf(fp, "%s%s %lu", n++ ? " " : "",
+					tif_attrib_names[i], a->v[i]);
+
+	if (!n)
+		fprintf(fp, "none");
+}
@@ -0,0 +1,50 @@
+//SPDX-License-Identifier: GPL-2.0-or-later
+/*
+ * Copyright (C) 2020 Intel Corporation
+ *
+ * Per-CPU interrupt, softirq and context switch counters used to
+ * attribute jitter to its causes.
+ *
+ * Snapshots are taken by the main thread around each test. The columns
+ * of the CPUs in /proc/interrupts and /proc/softirqs are found once from
+ * the header and the width of the rows, so that a snapshot reads each
+ * file once and picks the counts at cached offsets instead of splitting
+ * every row.
+ *
+ */
+
+#ifndef _TIF_ATTRIB_H
+#define _TIF_ATTRIB_H
+
+#include <stdio.h>
+#include <stdint.h>
+
+enum tif_attrib_src {
+	ATTRIB_IRQ, //Device interrupts
+	ATTRIB_TIMER, //Local timer interrupts (LOC)
+	ATTRIB_IPI, //Reschedule, function call, TLB shootdown and irq work IPIs
+	ATTRIB_NMI, //NMIs and performance monitoring interrupts
+	ATTRIB_OTHER, //Other architecture interrupts
+	ATTRIB_SOFTIRQ, //First of ATTRIB_SOFTIRQS softirqs in /proc/softirqs order
+	ATTRIB_VCSW = ATTRIB_SOFTIRQ + 10, //Voluntary context switches
+	ATTRIB_IVCSW, //Involuntary context switches
+	ATTRIB_NUM
+};
+
+#define ATTRIB_SOFTIRQS (ATTRIB_VCSW - ATTRIB_SOFTIRQ)
+
+struct tif_attrib {
+	uint64_t v[ATTRIB_NUM];
+};
+
+extern const char * const tif_attrib_names[ATTRIB_NUM];
+
+int tif_attrib_open(void);
+void tif_attrib_close(void);
+int tif_attrib_snap(const int *cpus, const int *tids, int num,
+		struct tif_attrib *snap);
+void tif_attrib_delta(struct tif_attrib *d, const struct tif_attrib *before,
+		const struct tif_attrib *after);
+void tif_attrib_print(const struct tif_attrib *a, FILE *fp);
+
+#endif //#ifndef _TIF_ATTRIB_H
@@ -0,0 +1,124 @@
+#!/bin/bash
+#SPDX-License-Identifier: GPL-2.0-or-later
+#Copyright (C) 2020 Intel Corporation
+#
+#Runs a fixed matrix of workloads x CPU placements x clock sources with
+#tif_jitter, plus repeated nohz entries with tif_test, and stores the
+#histogram and JSON result of every run in a directory. With a baseline
+#directory from an earlier run, every histogram is compared against it
+#with tif_compare and the exit status is 1 if any tail latency regressed.
+
+workloads="rand chase:l2 stream:1M fp"
+placements="first all" #first NOHZ CPU, all NOHZ CPUs or a CPU list
+clocks="mono tsc"
+tests=1000
+entries=1000 #tif_test nohz entries
+tolerance=10
+baseline=
+out=bench/$(date +%Y%m%d-%H%M%S)
+
+usage()
+{
+	echo "Usage: $0 [options]"
+	echo "-o <dir>         Result directory, default bench/<date-time>"
+	echo "-b <dir>         Baseline result directory to compare against"
+	echo "-T <percent>     Allowed growth of a percentile, default $tolerance"
+	echo "-t <num tests>   Tests per tif_jitter run, default $tests"
+	echo "-n <num>         tif_test nohz entries, default $entries"
+	echo "-w <list>        Workloads, default \"$workloads\""
+	echo "-a <list>        Placements: first, all or CPU lists,"
+	echo "                 default \"$placements\""
+	echo "-c <list>        Clocks: mono and/or tsc, default \"$clocks\""
+	exit 2
+}
+
+while getopts "o:b:T:t:n:w:a:c:" opt
+do
+	case $opt in
+	o) out=$OPTARG ;;
+	b) baseline=$OPTARG ;;
+	T) tolerance=$OPTARG ;;
+	t) tests=$OPTARG ;;
+	n) entries=$OPTARG ;;
+	w) workloads=$OPTARG ;;
+	a) placements=$OPTARG ;;
+	c) clocks=$OPTARG ;;
+	*) usage ;;
+	esac
+done
+
+mkdir -p "$out" || exit 2
+failed=0
+
+for wl in $workloads
+do
+	for place in $placements
+	do
+		case $place in
+		first) cpus= ;;
+		all) cpus=-A ;;
+		*) cpus="-a $place" ;;
+		esac
+
+		for clock in $clocks
+		do
+			opt=
+			[ "$clock" = tsc ] && opt=-c
+
+			name=${wl//[:\/]/_}-${place//,/_}-$clock
+			echo "Running $name"
+			./tif_jitter $cpus $opt -w "$wl" -t "$tests" \
+				-H "$out/$name.hist" -o json -O "$out/$name.json" \
+				> "$out/$name.log" 2>&1
+			#Histogram of a failed run has no samples
+			if ! grep -q "^# all samples [1-9]" "$out/$name.hist"
+			then
+				echo "tif_jitter failed, see $out/$name.log"
+				failed=1
+			fi
+		done
+	done
+done
+
+#Time taken to enter nohz state without and with forced entry, in process
+echo "Running tif_test with $entries nohz entries"
+if ! ./tif_test -n "$entries" -H "$out/tif_test.hist" > "$out/tif_test.log" 2>&1 ||
+	! grep -q "^# forced 0 samples [1-9]" "$out/tif_test.hist"
+then
+	echo "tif_test failed, see $out/tif_test.log"
+	failed=1
+fi
+
+echo "Results in $out"
+
+if [ -z "$baseline" ]
+then
+	exit $failed
+fi
+
+regressed=0
+for f in "$out"/*.hist
+do
+	base="$baseline/$(basename "$f")"
+	if [ ! -f "$base" ]
+	then
+		echo "$(basename "$f"): not in baseline"
+		continue
+	fi
+
+	echo "== $(basename "$f" .hist)"
+	./tif_compare -t "$tolerance" "$base" "$f"
+	case $? in
+	0) ;;
+	1) regressed=1 ;;
+	*) failed=1 ;;
+	esac
+done
+
+if [ $regressed -ne 0 ]
+then
+	echo "Tail latency regressed against $baseline"
+	exit 1
+fi
+
+exit $failed
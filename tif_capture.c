@@ -0,0 +1,200 @@
+//SPDX-License-Identifier: GPL-2.0-or-later
+/*
+ * Copyright (C) 2020 Intel Corporation
+ *
+ * Raw sample capture buffers and the writer thread streaming them
+ * to file
+ *
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include "tif_helper.h"
+#include "tif_capture.h"
+
+#define WRITER_POLL_US 1000
+#define WRITER_CPU 0 //Housekeeping CPU writer thread runs in
+
+static int capture_fd = -1;
+static struct tif_capture *captures;
+static int num_captures;
+static pthread_t writer_tid;
+static int writer_running;
+static int writer_stop;
+
+/*
+ * Allocates capture buffer with two halves of size samples each. The
+ * buffer is pre-faulted and locked in memory so that the RT thread does
+ * not take page faults writing to it.
+ *
+ * Returns 0 on success, -1 on error
+ */
+int tif_capture_init(struct tif_capture *c, int cpu, size_t size)
+{
+	size_t len = 2 * size * sizeof(struct tif_sample);
+	void *p;
+
+	memset(c, 0, sizeof(*c));
+
+	p = mmap(NULL, len, PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE, -1, 0);
+	if (p == MAP_FAILED)
+		return -1;
+
+	if (mlock(p, len)) {
+		munmap(p, len);
+		return -1;
+	}
+
+	c->buf[0] = p;
+	c->buf[1] = c->buf[0] + size;
+	c->size = size;
+	c->cpu = cpu;
+
+	return 0;
+}
+
+void tif_capture_free(struct tif_capture *c)
+{
+	if (c->buf[0])
+		munmap(c->buf[0], 2 * c->size * sizeof(struct tif_sample));
+	c->buf[0] = c->buf[1] = NULL;
+}
+
+/*
+ * Creates capture file and writes the file header
+ *
+ * Returns 0 on success, -1 on error
+ */
+int tif_capture_open(const char *file, int tsc)
+{
+	struct tif_capture_hdr hdr = { CAPTURE_MAGIC, tsc };
+
+	if (tsc) {
+		hdr.tsc_mult = tif_tsc.mult;
+		hdr.tsc_shift = tif_tsc.shift;
+		hdr.tsc_offset = tif_tsc.offset;
+	}
+
+	capture_fd = open(file, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (capture_fd < 0)
+		return -1;
+
+	if (write(capture_fd, &hdr, sizeof(hdr)) != sizeof(hdr)) {
+		close(capture_fd);
+		capture_fd = -1;
+		return -1;
+	}
+
+	return 0;
+}
+
+static void write_half(struct tif_capture *c, int h)
+{
+	struct tif_capture_chunk chunk;
+	struct iovec iov[2];
+
+	chunk.cpu = c->cpu;
+	chunk.count = c->count[h];
+	chunk.dropped = __atomic_load_n(&c->dropped, __ATOMIC_RELAXED);
+
+	iov[0].iov_base = &chunk;
+	iov[0].iov_len = sizeof(chunk);
+	iov[1].iov_base = c->buf[h];
+	iov[1].iov_len = c->count[h] * sizeof(struct tif_sample);
+
+	if (writev(capture_fd, iov, 2) < 0)
+		perror("Error writing capture file");
+
+	__atomic_store_n(&c->full[h], 0, __ATOMIC_RELEASE);
+}
+
+/*
+ * Writes all full halves to file in the order they were filled
+ */
+static void drain(void)
+{
+	struct tif_capture *c;
+	int f0, f1;
+
+	for (int i = 0; i < num_captures; i++) {
+		c = &captures[i];
+
+		f0 = __atomic_load_n(&c->full[0], __ATOMIC_ACQUIRE);
+		f1 = __atomic_load_n(&c->full[1], __ATOMIC_ACQUIRE);
+
+		if (f0 && f1 && c->seq[1] < c->seq[0]) {
+			write_half(c, 1);
+			write_half(c, 0);
+		} else {
+			if (f0)
+				write_half(c, 0);
+			if (f1)
+				write_half(c, 1);
+		}
+	}
+}
+
+static void *writer_thread(void *arg)
+{
+	//Keep file I/O away from the NOHZ CPUs
+	set_cpu_affinity(WRITER_CPU, 0);
+
+	while (!__atomic_load_n(&writer_stop, __ATOMIC_RELAXED)) {
+		drain();
+		usleep(WRITER_POLL_US);
+	}
+
+	return NULL;
+}
+
+/*
+ * Starts writer thread streaming num capture buffers to the file
+ * created by tif_capture_open()
+ *
+ * Returns 0 on success, -1 on error
+ */
+int tif_capture_start(struct tif_capture *caps, int num)
+{
+	captures = caps;
+	num_captures = num;
+	writer_stop = 0;
+
+	if (pthread_create(&writer_tid, NULL, &writer_thread, NULL))
+		return -1;
+
+	writer_running = 1;
+
+	return 0;
+}
+
+/*
+ * Stops writer thread, writes remaining samples and closes the file.
+ * RT threads must not be adding samples anymore.
+ */
+void tif_capture_stop(void)
+{
+	if (writer_running) {
+		__atomic_store_n(&writer_stop, 1, __ATOMIC_RELAXED);
+		pthread_join(writer_tid, NULL);
+		writer_running = 0;
+	}
+
+	if (capture_fd < 0)
+		return;
+
+	//Write the halves that became full after the last poll first
+	drain();
+	for (int i = 0; i < num_captures; i++)
+		tif_capture_flush(&captures[i]);
+	drain();
+
+	close(capture_fd);
+	capture_fd = -1;
+}
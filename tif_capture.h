@@ -0,0 +1,114 @@
+//SPDX-License-Identifier: GPL-2.0-or-later
+/*
+ * Copyright (C) 2020 Intel Corporation
+ *
+ * Raw sample capture from RT threads without system calls.
+ *
+ * Each RT thread has a capture buffer split in two halves that are
+ * allocated, pre-faulted and locked in memory before nohz entry. The RT
+ * thread fills one half while a writer thread running in a housekeeping
+ * CPU streams the other half to a binary file. If the writer falls
+ * behind, samples are dropped and counted instead of blocking the RT
+ * thread.
+ *
+ * File format (native endian):
+ *   struct tif_capture_hdr
+ *   Chunks of struct tif_capture_chunk followed by count samples of
+ *   struct tif_sample
+ *
+ */
+
+#ifndef _TIF_CAPTURE_H
+#define _TIF_CAPTURE_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define CAPTURE_MAGIC "TIFRAW1"
+#define CAPTURE_SAMPLES 65536 //Samples in each half of capture buffer
+
+/*
+ * If tsc is 1 samples are TSC ticks and can be converted to
+ * CLOCK_MONOTONIC nanoseconds as (ticks * tsc_mult >> tsc_shift) +
+ * tsc_offset. Else samples are CLOCK_MONOTONIC nanoseconds.
+ */
+struct tif_capture_hdr {
+	char magic[8];
+	uint32_t tsc;
+	uint32_t tsc_shift;
+	uint64_t tsc_mult;
+	int64_t tsc_offset;
+};
+
+struct tif_capture_chunk {
+	uint32_t cpu;
+	uint32_t count; //Number of samples following
+	uint64_t dropped; //Samples dropped by the CPU so far
+};
+
+struct tif_sample {
+	uint64_t start;
+	uint64_t end;
+};
+
+struct tif_capture {
+	struct tif_sample *buf[2];
+	size_t size; //Samples in each half
+	int cpu;
+
+	//Written by RT thread only
+	int cur;
+	size_t idx;
+	uint64_t dropped;
+	uint64_t flushes;
+
+	//Set by RT thread when half is full, cleared by writer
+	int full[2];
+	size_t count[2];
+	uint64_t seq[2]; //Order in which halves were filled
+};
+
+/*
+ * Publishes the current half to the writer and switches to the other
+ * half. Called by the RT thread when a half is full, and by the main
+ * thread at exit once the RT thread is done.
+ */
+static inline void tif_capture_flush(struct tif_capture *c)
+{
+	if (!c->idx)
+		return;
+
+	c->count[c->cur] = c->idx;
+	c->seq[c->cur] = c->flushes++;
+	__atomic_store_n(&c->full[c->cur], 1, __ATOMIC_RELEASE);
+	c->cur ^= 1;
+	c->idx = 0;
+}
+
+/*
+ * Stores a sample. Must not make system calls as it is called from the
+ * measured loop.
+ */
+static inline void tif_capture_add(struct tif_capture *c, uint64_t start,
+		uint64_t end)
+{
+	//Writer has not yet drained this half
+	if (__atomic_load_n(&c->full[c->cur], __ATOMIC_ACQUIRE)) {
+		__atomic_store_n(&c->dropped, c->dropped + 1, __ATOMIC_RELAXED);
+		return;
+	}
+
+	c->buf[c->cur][c->idx].start = start;
+	c->buf[c->cur][c->idx].end = end;
+
+	if (++c->idx == c->size)
+		tif_capture_flush(c);
+}
+
+int tif_capture_init(struct tif_capture *c, int cpu, size_t size);
+void tif_capture_free(struct tif_capture *c);
+int tif_capture_open(const char *file, int tsc);
+int tif_capture_start(struct tif_capture *caps, int num);
+void tif_capture_stop(void);
+
+#endif //#ifndef _TIF_CAPTURE_H
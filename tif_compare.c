@@ -0,0 +1,251 @@
+//SPDX-License-Identifier: GPL-2.0-or-later
+/*
+ * Copyright (C) 2020 Intel Corporation
+ *
+ * tif_compare - compares the histograms of a run against a baseline run
+ * and fails if tail latency regressed.
+ *
+ * Reads histogram files written by tif_jitter (-h/-H) and tif_test (-H).
+ * Sections with a header "# <name> samples ..." hold "low high count"
+ * bucket lines. Other sections, e.g. cause breakdowns, are skipped.
+ *
+ * Histograms with the same name are compared. The two sample two sided
+ * Kolmogorov-Smirnov test tells if the distributions differ. p99, p99.9
+ * and p99.99 that grew more than the tolerance are regressions when both
+ * runs have enough samples beyond the percentile. A p50 that grew more
+ * than the tolerance is a regression only if the KS test also finds the
+ * distributions different, since run to run noise moves the median.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <math.h>
+#include "tif_hist.h"
+
+#define TOLERANCE 10.0 //Default allowed growth of a percentile in %
+#define KS_ALPHA 0.001 //KS p-value under which distributions differ
+#define MIN_TAIL_SAMPLES 10 //Samples needed beyond a compared percentile
+#define NAME_LEN 64
+
+struct named_hist {
+	char name[NAME_LEN];
+	struct tif_hist h;
+};
+
+static const double pcts[] = { 50, 99, 99.9, 99.99 };
+
+double tolerance = TOLERANCE;
+int verbose;
+
+/*
+ * Reads all histograms in file
+ *
+ * Returns number of histograms read, -1 on error
+ */
+static int read_hists(const char *file, struct named_hist **hists)
+{
+	struct named_hist *cur = NULL, *h;
+	char line[1024], *p;
+	unsigned long long low, high, count, min, max;
+	int num = 0, idx;
+	FILE *fp;
+
+	fp = fopen(file, "r");
+	if (!fp) {
+		printf("Error opening %s\n", file);
+		return -1;
+	}
+
+	*hists = NULL;
+	while (fgets(line, sizeof(line), fp)) {
+		if (line[0] == '#') {
+			cur = NULL;
+			p = strstr(line, " samples ");
+			if (!p)
+				continue;
+
+			h = realloc(*hists, (num + 1) * sizeof(**hists));
+			if (!h) {
+				printf("Error allocating histogram\n");
+				fclose(fp);
+				return -1;
+			}
+			*hists = h;
+			cur = &h[num++];
+			memset(cur, 0, sizeof(*cur));
+			snprintf(cur->name, sizeof(cur->name), "%.*s",
+					(int)(p - line - 2), line + 2);
+
+			if (sscanf(p, " samples %*u min %llu max %llu",
+						&min, &max) == 2) {
+				cur->h.min = min;
+				cur->h.max = max;
+			}
+			continue;
+		}
+
+		if (!cur)
+			continue;
+
+		if (sscanf(line, "%llu %llu %llu", &low, &high, &count) == 3) {
+			idx = tif_hist_index(low);
+			cur->h.counts[idx] += count;
+			cur->h.count += count;
+		}
+	}
+
+	fclose(fp);
+
+	return num;
+}
+
+/*
+ * Returns the p-value of the KS statistic d for sample sizes n1 and n2
+ * from the asymptotic Kolmogorov distribution
+ */
+static double ks_pvalue(double d, double n1, double n2)
+{
+	double ne = n1 * n2 / (n1 + n2), l, p = 0, t;
+
+	l = (sqrt(ne) + 0.12 + 0.11 / sqrt(ne)) * d;
+	if (l < 0.2)
+		return 1;
+
+	for (int k = 1; k <= 100; k++) {
+		t = 2 * ((k & 1) ? 1 : -1) * exp(-2.0 * k * k * l * l);
+		p += t;
+		if (fabs(t) < 1e-12)
+			break;
+	}
+
+	return p < 0 ? 0 : p > 1 ? 1 : p;
+}
+
+/*
+ * Returns the largest difference of the cumulative distributions of two
+ * histograms at bucket boundaries
+ */
+static double ks_stat(const struct tif_hist *a, const struct tif_hist *b)
+{
+	uint64_t ca = 0, cb = 0;
+	double d = 0, diff;
+
+	for (int i = 0; i < HIST_BUCKETS; i++) {
+		ca += a->counts[i];
+		cb += b->counts[i];
+		diff = fabs((double)ca / a->count - (double)cb / b->count);
+		if (diff > d)
+			d = diff;
+	}
+
+	return d;
+}
+
+/*
+ * Compares histogram h of the new run to base and prints the result
+ *
+ * Returns 1 if h regressed, else 0
+ */
+static int compare(const char *name, const struct tif_hist *base,
+		const struct tif_hist *h)
+{
+	double d, p, change;
+	uint64_t vb, vn;
+	int regressed = 0, differ, r;
+
+	if (!base->count || !h->count) {
+		printf("%s: no samples\n", name);
+		return 0;
+	}
+
+	d = ks_stat(base, h);
+	p = ks_pvalue(d, base->count, h->count);
+	differ = p < KS_ALPHA;
+
+	printf("%s: samples %lu -> %lu, KS D %.4f p %.3g%s\n", name,
+			base->count, h->count, d, p,
+			differ ? " (distributions differ)" : "");
+
+	for (unsigned int i = 0; i < sizeof(pcts) / sizeof(pcts[0]); i++) {
+		//Too few samples beyond the percentile to compare it
+		if (base->count * (100 - pcts[i]) / 100 < MIN_TAIL_SAMPLES ||
+				h->count * (100 - pcts[i]) / 100 <
+				MIN_TAIL_SAMPLES)
+			continue;
+
+		vb = tif_hist_percentile(base, pcts[i]);
+		vn = tif_hist_percentile(h, pcts[i]);
+		change = vb ? (vn - (double)vb) * 100 / vb : 0;
+
+		r = change > tolerance && (pcts[i] > 50 || differ);
+		regressed |= r;
+
+		if (r || verbose)
+			printf("  p%g %lu -> %lu (%+.1f%%)%s\n", pcts[i], vb, vn,
+					change, r ? " REGRESSED" : "");
+	}
+
+	return regressed;
+}
+
+static void help(void)
+{
+	printf("\nUsage:\n\ntif_compare [options] <baseline file> <file>\n\n");
+	printf("-t <percent>     Allowed growth of a percentile, default %g\n",
+			TOLERANCE);
+	printf("-v               Print all compared percentiles\n");
+	printf("\nExit status 1 if a histogram regressed, 2 on error\n\n");
+}
+
+int main(int argc, char **argv)
+{
+	struct named_hist *base, *cur;
+	int nb, nc, o, j, regressed = 0;
+
+	while ((o = getopt(argc, argv, "t:v")) != -1) {
+		switch (o) {
+		case 't':
+			tolerance = atof(optarg);
+			break;
+		case 'v':
+			verbose = 1;
+			break;
+		default:
+			help();
+			return 2;
+		}
+	}
+
+	if (argc - optind != 2) {
+		help();
+		return 2;
+	}
+
+	nb = read_hists(argv[optind], &base);
+	nc = read_hists(argv[optind + 1], &cur);
+	if (nb < 0 || nc < 0)
+		return 2;
+
+	for (int i = 0; i < nc; i++) {
+		for (j = 0; j < nb; j++)
+			if (!strcmp(base[j].name, cur[i].name))
+				break;
+
+		if (j == nb) {
+			printf("%s: not in baseline\n", cur[i].name);
+			continue;
+		}
+
+		regressed |= compare(cur[i].name, &base[j].h, &cur[i].h);
+	}
+
+	free(base);
+	free(cur);
+
+	printf("%s\n", regressed ? "REGRESSED" : "OK");
+
+	return regressed;
+}
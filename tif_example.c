@@ -78,6 +78,22 @@ int main(int argc, char **argv)
 		goto ext;
 	}
 
+	/*
+	 * Page faults in the RT workload cause jitter. This locks all current
+	 * and future memory of the process and keeps malloc from returning
+	 * memory to the system. Stack used by the RT workload is faulted in
+	 * in advance. Buffers of the workload can be allocated with
+	 * tif_mem_alloc() which faults them in and locks them, optionally
+	 * with huge pages. These make system calls so are done before
+	 * waiting for nohz state entry.
+	 */
+	if (tif_mem_lock()) {
+		printf("Error locking memory\n");
+		goto ext;
+	}
+
+	tif_prefault_stack(64 * 1024);
+
 	/*
 	 * This synchronizes the entry into nohz state. When the RT thread is
 	 * scheduled in the isolated CPU, the kernel detecting it is the only
@@ -131,7 +147,7 @@ ext:
 	 *        Exit procedure common for all CPUs/RT threads
 	 *****************************************************************/
 	/*
-	 * Reverses 100% scheduler runtime assignment to RT tasks.
+	 * Restores the scheduler runtime setting saved by nohz_enter().
 	 * This is a global setting and calling this will cause RT tasks in all
 	 * CPUSs to exit nohz state.
 	 */
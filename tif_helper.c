@@ -15,63 +15,447 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <errno.h>
+#include <limits.h>
 #include <sched.h>
+#include <pthread.h>
 #include <time.h>
 #include <ctype.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <malloc.h>
+#include <alloca.h>
+#include <cpuid.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
 #include <numa.h>
+#include "tif_helper.h"
 
-//Wait time in secs for sched 100% runtime setting to take effect
-#define SCHED_RUNTIME_WAIT_SEC 1
+//Max time to wait for scheduler runtime setting to take effect
+#define SCHED_RUNTIME_TIMEOUT_US 1000000
+#define SCHED_RUNTIME_POLL_US 100
+
+#define SCHED_RT_RUNTIME "/proc/sys/kernel/sched_rt_runtime_us"
+#define SCHED_RT_PERIOD "/proc/sys/kernel/sched_rt_period_us"
+
+#define HUGE_PAGE_SIZE (2UL << 20)
+
+//Time over which TSC frequency is calibrated
+#define TSC_CALIBRATE_NS 100000000L
+//Number of timer reads to find the timer overhead
+#define TSC_OVERHEAD_LOOPS 10000
+#define TSC_SHIFT 32
+
+#define TIMER_LIST "/proc/timer_list"
+//Size of window read from timer_list in the fast tick stopped check
+#define TICK_BUF_SIZE 8192
+//Bytes before cached CPU section offset included in the window
+#define TICK_SLACK 2048
+
+/*
+ * Offsets of each CPU's section in /proc/timer_list found by the last
+ * check. The sections before move by a few bytes as timers get added
+ * or removed, so the cached offset is only used as a hint.
+ * 0 = not known yet.
+ */
+static long tick_offset[CPU_SETSIZE];
 
 /*******************************************************************
- * Functions to synchronize nohz state entry
+ * Saved system settings
  ******************************************************************/
 /*
- * Assigns scheduler runtime to RT tasks passed as percentage
- * of scheduler period in the range of 95 to 100.
+ * Original values of the system settings changed by TIF. Value strings
+ * are kept as read so that they can be written back from a signal
+ * handler with only open(), write() and close(). The array grows as
+ * settings are saved, e.g. one per IRQ, and is replaced rather than
+ * reallocated in place so that a signal handler never sees it freed
+ * before the new one is in place.
+ */
+struct saved_setting {
+	char *path;
+	char val[128];
+};
+
+static struct saved_setting *saved;
+static int saved_size;
+static char state_file[PATH_MAX] = TIF_STATE_FILE;
+static char state_tmp[PATH_MAX + 4] = TIF_STATE_FILE ".tmp";
+static volatile int num_saved;
+static pthread_mutex_t state_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * Writes str to a /proc or /sys file. Async signal safe.
  *
- * Params:
- * int runtime_perc: percentage between 95 and 100.
+ * Returns 0 on success, -1 on error
+ */
+static int write_setting(const char *path, const char *str)
+{
+	int fd, ret = 0;
+	ssize_t len = strlen(str);
+
+	fd = open(path, O_WRONLY | O_TRUNC);
+	if (fd < 0)
+		return -1;
+
+	if (write(fd, str, len) != len)
+		ret = -1;
+
+	//Write error of sysctl can be reported at close
+	if (close(fd))
+		ret = -1;
+
+	return ret;
+}
+
+/*
+ * Reads the value of a /proc or /sys file into val without the trailing
+ * newline. For files listing choices with the current one in brackets
+ * like "always [madvise] never", only the current choice is read.
  *
  * Returns 0 on success, -1 on error
+ */
+static int read_setting(const char *path, char *val, int size)
+{
+	FILE *fp;
+	char *ptr, *end;
+
+	fp = fopen(path, "rb");
+	if (!fp)
+		return -1;
+
+	ptr = fgets(val, size, fp);
+	fclose(fp);
+
+	if (!ptr)
+		return -1;
+
+	val[strcspn(val, "\n")] = 0;
+
+	ptr = strchr(val, '[');
+	end = ptr ? strchr(ptr, ']') : NULL;
+	if (end) {
+		*end = 0;
+		memmove(val, ptr + 1, end - ptr);
+	}
+
+	return 0;
+}
+
+/*
+ * Writes saved settings to TIF_STATE_FILE through a temporary file so
+ * that a complete file is always present
  *
+ * Returns 0 on success, -1 on error
  */
-static int set_sched_runtime(int runtime_perc)
+static int write_state_file(void)
 {
-	char str[128];
 	FILE *fp;
-	int p, r;
-	char *ptr;
-	int ret = -1;
+	int ret = 0;
 
-	fp = fopen("/proc/sys/kernel/sched_rt_period_us", "rb");
-	if (fp) {
-		ptr = fgets(str, 128, fp);
-		fclose(fp);
+	fp = fopen(state_tmp, "wb");
+	if (!fp)
+		return -1;
+
+	fprintf(fp, "pid %d\n", getpid());
+	for (int i = 0; i < num_saved; i++)
+		fprintf(fp, "%s %s\n", saved[i].path, saved[i].val);
+
+	if (fclose(fp))
+		ret = -1;
+
+	if (!ret && rename(state_tmp, state_file))
+		ret = -1;
+
+	if (ret)
+		unlink(state_tmp);
+
+	return ret;
+}
 
-		if (!ptr)
+/*
+ * Appends a setting to the saved settings, growing the array as needed
+ *
+ * Returns 0 on success, -1 if out of memory
+ */
+static int add_saved(const char *path, const char *val)
+{
+	struct saved_setting *s, *old = saved;
+	int size = saved_size ? saved_size * 2 : 64;
+	char *p;
+
+	if (num_saved == saved_size) {
+		s = malloc(size * sizeof(*s));
+		if (!s)
 			return -1;
+		if (num_saved)
+			memcpy(s, old, num_saved * sizeof(*s));
+		__atomic_store_n(&saved, s, __ATOMIC_RELEASE);
+		saved_size = size;
+		free(old);
+	}
+
+	p = strdup(path);
+	if (!p)
+		return -1;
+
+	saved[num_saved].path = p;
+	snprintf(saved[num_saved].val, sizeof(saved[num_saved].val), "%s", val);
+	num_saved++;
+
+	return 0;
+}
+
+//Frees the paths of the saved settings after they are dropped
+static void free_saved(int num)
+{
+	for (int i = 0; i < num; i++) {
+		free(saved[i].path);
+		saved[i].path = NULL;
+	}
+}
+
+/*
+ * Loads settings from a TIF_STATE_FILE left by a process that did not
+ * restore them. These are the original values, not the current ones.
+ *
+ * Returns 0 on success or if there is no file, -1 with errno EBUSY if the
+ * process that wrote it is still running, -1 if it cannot be loaded
+ * completely
+ */
+static int read_state_file(void)
+{
+	char *line = NULL, *val;
+	size_t size = 0;
+	FILE *fp;
+	int pid, ret = 0;
 
-		p = atoi(str);
+	fp = fopen(state_file, "rb");
+	if (!fp)
+		return 0;
 
-		r = -1; //-1 = 100%
-		if (runtime_perc < 100) {
-			runtime_perc = runtime_perc < 95 ? 95 : runtime_perc;
-			r = ((p * runtime_perc) / 100);
+	while (getline(&line, &size, fp) != -1) {
+		line[strcspn(line, "\n")] = 0;
+
+		//Settings of a running process are its own to restore
+		if (sscanf(line, "pid %d", &pid) == 1) {
+			if (pid != getpid() && (!kill(pid, 0) || errno == EPERM)) {
+				errno = EBUSY;
+				ret = -1;
+				break;
+			}
+			continue;
+		}
+
+		val = strchr(line, ' ');
+		if (!val || strlen(val + 1) >= sizeof(saved->val)) {
+			ret = -1;
+			break;
+		}
+		*val++ = 0;
+
+		if (add_saved(line, val)) {
+			ret = -1;
+			break;
 		}
+	}
+
+	free(line);
+	fclose(fp);
+
+	//Partly loaded settings are not restored
+	if (ret) {
+		free_saved(num_saved);
+		num_saved = 0;
+	}
+
+	return ret;
+}
+
+/*
+ * Sets the file settings are saved in, NULL for TIF_STATE_FILE. Must be
+ * called before any setting is saved, e.g. to keep the state of a fake
+ * /proc and /sys tree with it.
+ *
+ * Returns 0 on success, -1 if settings are already saved or file name is
+ * too long
+ */
+int tif_state_set_file(const char *file)
+{
+	int ret = -1;
+
+	if (!file)
+		file = TIF_STATE_FILE;
+
+	pthread_mutex_lock(&state_lock);
+
+	if (!num_saved && strlen(file) < sizeof(state_file)) {
+		strcpy(state_file, file);
+		snprintf(state_tmp, sizeof(state_tmp), "%s.tmp", file);
+		ret = 0;
+	}
+
+	pthread_mutex_unlock(&state_lock);
+
+	return ret;
+}
+
+const char *tif_state_file(void)
+{
+	return state_file;
+}
 
-		fp = fopen("/proc/sys/kernel/sched_rt_runtime_us", "wb");
-		if (fp) {
-			sprintf(str, "%d", r);
-			fputs(str, fp);
-			fclose(fp);
+/*
+ * Saves the current value of a system setting before TIF changes it.
+ * The value is kept in memory and in TIF_STATE_FILE so that it can be
+ * restored by tif_state_restore() even if the process is killed. If the
+ * file was left by an earlier process, the values in it are kept as the
+ * originals. Saving a setting again does nothing.
+ *
+ * Params:
+ * const char *path: /proc or /sys file of the setting
+ *
+ * Returns 0 on success, -1 on error
+ */
+int tif_state_save(const char *path)
+{
+	char val[sizeof(saved->val)];
+	int ret = -1;
+
+	pthread_mutex_lock(&state_lock);
+
+	if (!num_saved && read_state_file())
+		goto ext;
+
+	for (int i = 0; i < num_saved; i++) {
+		if (!strcmp(saved[i].path, path)) {
 			ret = 0;
+			goto ext;
 		}
 	}
 
+	if (read_setting(path, val, sizeof(val)) || add_saved(path, val))
+		goto ext;
+
+	ret = write_state_file();
+
+ext:
+	pthread_mutex_unlock(&state_lock);
+
+	return ret;
+}
+
+/*
+ * Writes back saved settings in the order they were saved and removes
+ * TIF_STATE_FILE. Async signal safe.
+ *
+ * Returns 0 on success, -1 if any setting could not be restored
+ */
+static int restore_saved(void)
+{
+	int ret = 0;
+
+	for (int i = 0; i < num_saved; i++)
+		if (write_setting(saved[i].path, saved[i].val))
+			ret = -1;
+
+	num_saved = 0;
+	unlink(state_file);
+
+	return ret;
+}
+
+/*
+ * Restores all saved settings. If none were saved by this process,
+ * restores the ones in TIF_STATE_FILE left by a process that was killed
+ * before restoring them.
+ *
+ * Returns 0 on success or if nothing was saved, -1 on error. errno is
+ * EBUSY if the file belongs to a running process and was left alone.
+ */
+int tif_state_restore(void)
+{
+	int ret = -1, num;
+
+	pthread_mutex_lock(&state_lock);
+
+	if (!num_saved && read_state_file())
+		goto ext;
+
+	num = num_saved;
+	ret = restore_saved();
+	free_saved(num);
+
+ext:
+	pthread_mutex_unlock(&state_lock);
+
 	return ret;
 }
 
+static void restore_signal_handler(int sig)
+{
+	restore_saved();
+
+	//Handler was reset to default, terminate as the signal would have
+	raise(sig);
+}
+
+/*
+ * Installs handlers restoring saved settings on termination and crash
+ * signals. SIGINT is left to the application. Settings are not restored
+ * on SIGKILL, but are restored by the next tif_state_restore() or
+ * nohz_enter() from TIF_STATE_FILE.
+ *
+ * Returns 0 on success, -1 on error
+ */
+int tif_state_restore_on_signal(void)
+{
+	static const int sigs[] = {
+		SIGTERM, SIGHUP, SIGQUIT, SIGSEGV, SIGBUS, SIGFPE, SIGILL, SIGABRT
+	};
+	struct sigaction sa;
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = restore_signal_handler;
+	sa.sa_flags = SA_RESETHAND;
+	sigemptyset(&sa.sa_mask);
+
+	for (unsigned int i = 0; i < sizeof(sigs) / sizeof(sigs[0]); i++)
+		if (sigaction(sigs[i], &sa, NULL))
+			return -1;
+
+	return 0;
+}
+
+/*******************************************************************
+ * Functions to synchronize nohz state entry
+ ******************************************************************/
+/*
+ * Reads /proc/sys/kernel/sched_rt_runtime_us
+ *
+ * Returns 0 on success, -1 on error
+ */
+static int get_sched_runtime(int *runtime)
+{
+	char str[128];
+	FILE *fp;
+	char *ptr;
+
+	fp = fopen(SCHED_RT_RUNTIME, "rb");
+	if (!fp)
+		return -1;
+
+	ptr = fgets(str, 128, fp);
+	fclose(fp);
+
+	if (!ptr)
+		return -1;
+
+	*runtime = atoi(str);
+
+	return 0;
+}
+
 int set_cpu_affinity(int cpu, int pid);
 
 /*
@@ -130,6 +514,9 @@ static int get_tick_stopped(char *line)
 }
 
 /*
+ * Parses whole of /proc/timer_list to find the tick stopped state of cpu.
+ * Also caches the offset of cpu's section for tick_stopped_window().
+ *
  * Returns 1 if tick is stopped, 0 if not stopped, -1 on error
  */
 static int is_tick_stopped(int cpu)
@@ -137,12 +524,17 @@ static int is_tick_stopped(int cpu)
 	FILE *fp;
 	char *line = NULL;
 	size_t size = 0;
+	ssize_t len;
+	long pos = 0;
 	int stopped = -1;
 
-	fp = fopen("/proc/timer_list", "rb");
+	fp = fopen(TIMER_LIST, "rb");
 	if (fp) {
-		while (getline(&line, &size, fp) != -1) {
+		while ((len = getline(&line, &size, fp)) != -1) {
 			if (is_cur_cpu_data(cpu, line)) {
+				if (cpu < CPU_SETSIZE)
+					__atomic_store_n(&tick_offset[cpu], pos,
+							__ATOMIC_RELAXED);
 				while (getline(&line, &size, fp) != -1) {
 					stopped = get_tick_stopped(line);
 					if (stopped != -1)
@@ -150,6 +542,7 @@ static int is_tick_stopped(int cpu)
 				}
 				break;
 			}
+			pos += len;
 		}
 		free(line);
 		fclose(fp);
@@ -158,6 +551,104 @@ static int is_tick_stopped(int cpu)
 	return stopped;
 }
 
+/*
+ * Finds the "cpu: <cpu>" line in buf
+ *
+ * Returns pointer to the line, NULL if not found
+ */
+static char *find_cpu_data(int cpu, char *buf)
+{
+	char *p = buf;
+
+	while ((p = strstr(p, "cpu:"))) {
+		if ((p == buf || p[-1] == '\n') && is_cur_cpu_data(cpu, p))
+			return p;
+		p += 4;
+	}
+
+	return NULL;
+}
+
+/*
+ * Reads only a window of /proc/timer_list around the cached offset of
+ * cpu's section with pread() into buf instead of parsing the whole file.
+ * The file is usually hundreds of KB on large systems. fd must be open
+ * on /proc/timer_list.
+ *
+ * Returns 1 if tick is stopped, 0 if not stopped, -1 if the section was
+ * not found in the window
+ */
+static int tick_stopped_window(int fd, int cpu, char *buf, size_t size)
+{
+	long off, start;
+	ssize_t len;
+	char *p, *next;
+	int stopped;
+
+	if (fd < 0 || cpu >= CPU_SETSIZE)
+		return -1;
+
+	off = __atomic_load_n(&tick_offset[cpu], __ATOMIC_RELAXED);
+	if (!off)
+		return -1;
+
+	start = off > TICK_SLACK ? off - TICK_SLACK : 0;
+	len = pread(fd, buf, size - 1, start);
+	if (len <= 0)
+		return -1;
+	buf[len] = 0;
+
+	p = find_cpu_data(cpu, buf);
+	if (!p)
+		return -1;
+
+	__atomic_store_n(&tick_offset[cpu], start + (p - buf), __ATOMIC_RELAXED);
+
+	//Limit search to this CPU's section
+	next = find_cpu_data(cpu + 1, p);
+	if (next)
+		*next = 0;
+
+	while ((p = strchr(p, '\n'))) {
+		p++;
+		stopped = get_tick_stopped(p);
+		if (stopped != -1) {
+			//Line must be complete to be parsed
+			return strchr(p, '\n') ? stopped : -1;
+		}
+	}
+
+	return -1;
+}
+
+/*
+ * Checks tick stopped state of cpu using given method. Fast method falls
+ * back to full parsing if the CPU's section could not be located.
+ *
+ * Params:
+ * int cpu: CPU to check
+ * int method: TICK_CHECK_FAST or TICK_CHECK_FULL
+ *
+ * Returns 1 if tick is stopped, 0 if not stopped, -1 on error
+ */
+int nohz_tick_stopped(int cpu, int method)
+{
+	char buf[TICK_BUF_SIZE];
+	int fd, stopped = -1;
+
+	if (method == TICK_CHECK_FAST) {
+		fd = open(TIMER_LIST, O_RDONLY);
+		stopped = tick_stopped_window(fd, cpu, buf, sizeof(buf));
+		if (fd >= 0)
+			close(fd);
+	}
+
+	if (stopped == -1)
+		stopped = is_tick_stopped(cpu);
+
+	return stopped;
+}
+
 /*
  * This function will wait till nohz state is entered. The scheduler could take
  * some time to clear pending interrupts and other conditions necessary before
@@ -188,58 +679,546 @@ static int is_tick_stopped(int cpu)
  */
 long nohz_wait(long usecs, int forced)
 {
+	char buf[TICK_BUF_SIZE];
 	long t1, t2;
 	int cpu = sched_getcpu();
 	int tick_stopped;
+	int fd;
+	long ret = -1;
+
+	//Kept open across polls for the fast check
+	fd = open(TIMER_LIST, O_RDONLY);
 
 	t1 = get_time();
 
 	do {
 		t2 = get_time();
 
-		tick_stopped = is_tick_stopped(cpu);
+		tick_stopped = tick_stopped_window(fd, cpu, buf, sizeof(buf));
 		if (tick_stopped == -1)
-			return -2;
-		if (tick_stopped == 1)
-			return 0;
+			tick_stopped = is_tick_stopped(cpu);
+		if (tick_stopped == -1) {
+			ret = -2;
+			break;
+		}
+		if (tick_stopped == 1) {
+			ret = 0;
+			break;
+		}
 		if (forced)
 			toggle_affinity();
 
 	} while (t2-t1 < usecs);
 
-	return -1;
+	if (fd >= 0)
+		close(fd);
+
+	return ret;
 }
 
 /*
- * Assigns 100% scheduler runtime to RT tasks by setting
- * /proc/sys/kernel/sched_rt_runtime_us to -1
+ * Number of users of the 100% scheduler runtime setting in the process.
+ * Each nohz_enter(), nohz_enter_async() or tif_thread_enter() is a user.
+ */
+static int runtime_users;
+static pthread_mutex_t runtime_lock = PTHREAD_MUTEX_INITIALIZER;
+
+//State of the scheduler runtime setting made by the first user
+#define RUNTIME_PENDING 0 //Written, not yet confirmed
+#define RUNTIME_SET 1
+#define RUNTIME_ERR 2
+static int runtime_state;
+static int runtime_val; //Value written to sched_rt_runtime_us
+static long runtime_start; //Time of write in microseconds
+
+/*
+ * Starts assigning 100% scheduler runtime to RT tasks by setting
+ * /proc/sys/kernel/sched_rt_runtime_us to -1 if this is the first user,
+ * without waiting for the setting to take effect. Allows the caller to
+ * overlap the wait with other setup like thread creation and affinity.
+ * nohz_enter_wait() must be called before running RT tasks and
+ * nohz_exit() when done, even if nohz_enter_wait() fails.
  *
  * Return: 0 on success, -1 on error
  *
  */
-int nohz_enter(void)
+int nohz_enter_async(void)
 {
-	// Percentage must be in the range 95 - 100
-	if (set_sched_runtime(100))
-		return -1;
+	int ret = 0;
 
-	//Wait for runtime setting to take effect
-	sleep(SCHED_RUNTIME_WAIT_SEC);
+	pthread_mutex_lock(&runtime_lock);
 
-	return 0;
+	if (!runtime_users) {
+		//Period is saved first as it is restored first
+		if (tif_state_save(SCHED_RT_PERIOD) ||
+				tif_state_save(SCHED_RT_RUNTIME)) {
+			ret = -1;
+			goto ext;
+		}
+
+		//-1 = 100%
+		runtime_val = -1;
+		if (write_setting(SCHED_RT_RUNTIME, "-1")) {
+			ret = -1;
+			goto ext;
+		}
+
+		runtime_state = RUNTIME_PENDING;
+		runtime_start = get_time();
+	}
+
+	runtime_users++;
+
+ext:
+	pthread_mutex_unlock(&runtime_lock);
+
+	return ret;
+}
+
+/*
+ * Waits for the scheduler runtime setting started by nohz_enter_async()
+ * to take effect by reading back the value till it matches. Returns as
+ * soon as it does, or after SCHED_RUNTIME_TIMEOUT_US from the write.
+ * Can be called by multiple threads. The lock is not held while polling
+ * so that other threads can enter and exit meanwhile.
+ *
+ * Return: 0 on success, -1 on error or timeout
+ *
+ */
+int nohz_enter_wait(void)
+{
+	int r, val, state;
+	long start;
+
+	pthread_mutex_lock(&runtime_lock);
+	if (!runtime_users) {
+		pthread_mutex_unlock(&runtime_lock);
+		return -1;
+	}
+	val = runtime_val;
+	start = runtime_start;
+	state = runtime_state;
+	pthread_mutex_unlock(&runtime_lock);
+
+	while (state == RUNTIME_PENDING) {
+		if (!get_sched_runtime(&r) && r == val)
+			state = RUNTIME_SET;
+		else if (get_time() - start > SCHED_RUNTIME_TIMEOUT_US)
+			state = RUNTIME_ERR;
+		else
+			usleep(SCHED_RUNTIME_POLL_US);
+
+		//Another thread may have finished the wait, or the setting
+		//may have been reverted and written again by a new first user
+		pthread_mutex_lock(&runtime_lock);
+		if (!runtime_users || runtime_start != start) {
+			state = RUNTIME_ERR;
+		} else if (runtime_state != RUNTIME_PENDING) {
+			state = runtime_state;
+		} else {
+			runtime_state = state;
+		}
+		pthread_mutex_unlock(&runtime_lock);
+	}
+
+	return state == RUNTIME_SET ? 0 : -1;
+}
+
+/*
+ * Assigns 100% scheduler runtime to RT tasks by setting
+ * /proc/sys/kernel/sched_rt_runtime_us to -1 if this is the first user
+ * and waits for the setting to take effect.
+ *
+ * Return: 0 on success, -1 on error
+ *
+ */
+int nohz_enter(void)
+{
+	if (nohz_enter_async())
+		return -1;
+
+	if (nohz_enter_wait()) {
+		nohz_exit();
+		return -1;
+	}
+
+	return 0;
 }
 
 /*
  * Called to revert 100% scheduler runtime assignment
  *
- * Since scheduler runtime setting is a system wide setting,
- * this should be called only after all RT tasks are completed.
+ * Since scheduler runtime setting is a system wide setting, it is
+ * reverted only when the last user in the process exits. The original
+ * scheduler runtime and period, and any other setting saved with
+ * tif_state_save(), are restored. Calls without a matching nohz_enter()
+ * do nothing.
  *
  * Returns 0 on succes, -1 on error
  */
 int nohz_exit(void)
 {
-	return set_sched_runtime(95);
+	int ret = 0;
+
+	pthread_mutex_lock(&runtime_lock);
+
+	if (runtime_users && !--runtime_users)
+		ret = tif_state_restore();
+
+	pthread_mutex_unlock(&runtime_lock);
+
+	return ret;
+}
+
+/*******************************************************************
+ * Context API
+ ******************************************************************/
+struct tif_ctx {
+	pthread_mutex_t lock;
+	int sessions; //Threads currently entered through this context
+	long wait_us;
+	long forced_wait_us;
+};
+
+//Context the calling thread has a session in, NULL if none
+static __thread struct tif_ctx *thread_ctx;
+
+static const char * const tif_errors[] = {
+	[0] = "Success",
+	[-TIF_ERR_TIMEOUT] = "Timed out waiting for nohz state",
+	[-TIF_ERR_NO_NOHZ] = "Kernel does not support nohz",
+	[-TIF_ERR_SYS] = "System call failed",
+	[-TIF_ERR_INVAL] = "Invalid argument",
+	[-TIF_ERR_NOMEM] = "Out of memory",
+	[-TIF_ERR_STATE] = "No session or session already active",
+};
+
+/*
+ * Returns description of a TIF_ERR_* error code
+ */
+const char *tif_strerror(int err)
+{
+	if (err > 0 || -err >= (int)(sizeof(tif_errors) / sizeof(tif_errors[0])))
+		return "Unknown error";
+
+	return tif_errors[-err];
+}
+
+/*
+ * Creates a context with default nohz wait times of TIF_WAIT_US without
+ * forced entry followed by TIF_FORCED_WAIT_US with forced entry.
+ *
+ * Returns context, NULL if out of memory
+ */
+struct tif_ctx *tif_ctx_create(void)
+{
+	struct tif_ctx *ctx = calloc(1, sizeof(*ctx));
+
+	if (!ctx)
+		return NULL;
+
+	pthread_mutex_init(&ctx->lock, NULL);
+	ctx->wait_us = TIF_WAIT_US;
+	ctx->forced_wait_us = TIF_FORCED_WAIT_US;
+
+	return ctx;
+}
+
+/*
+ * Destroys context. All threads must have exited their sessions.
+ *
+ * Returns 0 on success, TIF_ERR_STATE if sessions are still active
+ */
+int tif_ctx_destroy(struct tif_ctx *ctx)
+{
+	if (ctx->sessions)
+		return TIF_ERR_STATE;
+
+	pthread_mutex_destroy(&ctx->lock);
+	free(ctx);
+
+	return 0;
+}
+
+/*
+ * Sets microseconds to wait for nohz entry without and with forced
+ * entry. A wait of 0 skips that step.
+ */
+void tif_ctx_set_wait(struct tif_ctx *ctx, long wait_us, long forced_wait_us)
+{
+	ctx->wait_us = wait_us;
+	ctx->forced_wait_us = forced_wait_us;
+}
+
+/*
+ * Starts an isolation session for the calling thread. Assigns 100%
+ * scheduler runtime to RT tasks if this is the first session in the
+ * process, affines the thread to cpu, sets FIFO policy with max
+ * priority and waits for nohz entry.
+ *
+ * Params:
+ * struct tif_ctx *ctx: context
+ * int cpu: nohz_full CPU to run the thread in
+ *
+ * Returns 0 on success, TIF_ERR_* on error. On error the session is
+ * not started. TIF_ERR_STATE if the thread already has a session.
+ */
+int tif_thread_enter(struct tif_ctx *ctx, int cpu)
+{
+	long ret = TIF_ERR_TIMEOUT;
+
+	if (!ctx || !is_nohz_cpu(cpu))
+		return TIF_ERR_INVAL;
+
+	if (thread_ctx)
+		return TIF_ERR_STATE;
+
+	if (nohz_enter())
+		return TIF_ERR_SYS;
+
+	if (set_cpu_affinity(cpu, 0) < 0 || set_sched_fifo(0) < 0) {
+		nohz_exit();
+		return TIF_ERR_SYS;
+	}
+
+	if (ctx->wait_us)
+		ret = nohz_wait(ctx->wait_us, 0);
+
+	if (ret == -1 && ctx->forced_wait_us)
+		ret = nohz_wait(ctx->forced_wait_us, 1);
+
+	if (ret < 0) {
+		nohz_exit();
+		return ret == -2 ? TIF_ERR_NO_NOHZ : TIF_ERR_TIMEOUT;
+	}
+
+	pthread_mutex_lock(&ctx->lock);
+	ctx->sessions++;
+	pthread_mutex_unlock(&ctx->lock);
+
+	thread_ctx = ctx;
+
+	return 0;
+}
+
+/*
+ * Ends the isolation session of the calling thread. Scheduler runtime
+ * is reverted when the last session in the process ends.
+ *
+ * Returns 0 on success, TIF_ERR_* on error. TIF_ERR_STATE if the thread
+ * has no session in ctx, e.g. it did not enter or already exited.
+ */
+int tif_thread_exit(struct tif_ctx *ctx)
+{
+	int ret = 0;
+
+	if (!ctx)
+		return TIF_ERR_INVAL;
+
+	if (thread_ctx != ctx)
+		return TIF_ERR_STATE;
+
+	thread_ctx = NULL;
+
+	pthread_mutex_lock(&ctx->lock);
+	ctx->sessions--;
+	pthread_mutex_unlock(&ctx->lock);
+
+	if (nohz_exit())
+		ret = TIF_ERR_SYS;
+
+	return ret;
+}
+
+/*******************************************************************
+ * Timing functions
+ ******************************************************************/
+struct tif_tsc tif_tsc;
+
+static long get_time_ns(clockid_t clk)
+{
+	struct timespec time;
+
+	clock_gettime(clk, &time);
+
+	return time.tv_sec * 1000000000L + time.tv_nsec;
+}
+
+/*
+ * Reads TSC and clock together. Retries to keep the window between the
+ * two reads of the clock small.
+ */
+static void read_tsc_clock(uint64_t *tsc, long *ns, clockid_t clk)
+{
+	long t1, t2, best = -1;
+	uint64_t t;
+
+	for (int i = 0; i < 10; i++) {
+		t1 = get_time_ns(clk);
+		t = tif_tsc_start();
+		t2 = get_time_ns(clk);
+
+		if (best < 0 || t2 - t1 < best) {
+			best = t2 - t1;
+			*tsc = t;
+			*ns = t1 + (t2 - t1) / 2;
+		}
+	}
+}
+
+/*
+ * Returns 1 if CPU reports invariant TSC
+ */
+static int tsc_invariant(void)
+{
+	unsigned int eax, ebx, ecx, edx;
+
+	if (!__get_cpuid(0x80000007, &eax, &ebx, &ecx, &edx))
+		return 0;
+
+	return !!(edx & (1 << 8));
+}
+
+/*
+ * Gets the mult/shift the kernel uses to convert TSC to nanoseconds from
+ * the mmap page of a perf event. Available if the kernel clocksource is
+ * TSC.
+ *
+ * Returns 0 on success, -1 if not available
+ */
+static int tsc_from_kernel(void)
+{
+	struct perf_event_attr attr;
+	struct perf_event_mmap_page *pc;
+	uint32_t seq, shift = 0;
+	uint64_t mult = 0;
+	int cap = 0;
+	int fd;
+
+	memset(&attr, 0, sizeof(attr));
+	attr.size = sizeof(attr);
+	attr.type = PERF_TYPE_SOFTWARE;
+	attr.config = PERF_COUNT_SW_DUMMY;
+	attr.exclude_kernel = 1;
+
+	fd = syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+	if (fd < 0)
+		return -1;
+
+	pc = mmap(NULL, sysconf(_SC_PAGESIZE), PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (pc == MAP_FAILED)
+		return -1;
+
+	//Kernel updates the page under a sequence lock
+	do {
+		seq = __atomic_load_n(&pc->lock, __ATOMIC_ACQUIRE);
+		cap = pc->cap_user_time;
+		mult = pc->time_mult;
+		shift = pc->time_shift;
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	} while (__atomic_load_n(&pc->lock, __ATOMIC_RELAXED) != seq);
+
+	munmap(pc, sysconf(_SC_PAGESIZE));
+
+	if (!cap || !mult)
+		return -1;
+
+	tif_tsc.mult = mult;
+	tif_tsc.shift = shift;
+	tif_tsc.hz = ((unsigned __int128)1000000000L << shift) / mult;
+	tif_tsc.source = TSC_SRC_KERNEL;
+
+	return 0;
+}
+
+/*
+ * Calibrates TSC frequency against CLOCK_MONOTONIC_RAW
+ *
+ * Returns 0 on success, -1 on error
+ */
+static int tsc_calibrate(void)
+{
+	uint64_t tsc1, tsc2;
+	long ns1, ns2;
+
+	read_tsc_clock(&tsc1, &ns1, CLOCK_MONOTONIC_RAW);
+	do {
+		read_tsc_clock(&tsc2, &ns2, CLOCK_MONOTONIC_RAW);
+	} while (ns2 - ns1 < TSC_CALIBRATE_NS);
+
+	if (tsc2 <= tsc1)
+		return -1;
+
+	tif_tsc.hz = (unsigned __int128)(tsc2 - tsc1) * 1000000000L /
+		(ns2 - ns1);
+	tif_tsc.shift = TSC_SHIFT;
+	tif_tsc.mult = ((unsigned __int128)1000000000L << TSC_SHIFT) /
+		tif_tsc.hz;
+	tif_tsc.source = TSC_SRC_CALIBRATED;
+
+	return 0;
+}
+
+/*
+ * Returns nanoseconds by which TSC converted to CLOCK_MONOTONIC time
+ * differs from CLOCK_MONOTONIC now. Used to validate the TSC clock
+ * outside the measured loop, e.g. before and after a run.
+ */
+int64_t tif_tsc_drift(void)
+{
+	uint64_t tsc;
+	long ns;
+
+	read_tsc_clock(&tsc, &ns, CLOCK_MONOTONIC);
+
+	return tif_tsc_to_mono(tsc) - ns;
+}
+
+/*
+ * Sets up conversion of TSC to nanoseconds and measures the overhead of
+ * tif_tsc_start()/tif_tsc_stop() and of a fenced clock_gettime() pair.
+ * Conversion uses the kernel's mult/shift if available, else calibrates
+ * which takes about 100ms. The offset to CLOCK_MONOTONIC is snapshotted
+ * so that tif_tsc_to_mono() can be used for absolute timestamps.
+ *
+ * Returns 0 on success, -1 on error
+ */
+int tif_tsc_init(void)
+{
+	uint64_t tsc, t, min;
+	long ns;
+
+	tif_tsc.invariant = tsc_invariant();
+
+	if (tsc_from_kernel() && tsc_calibrate())
+		return -1;
+
+	read_tsc_clock(&tsc, &ns, CLOCK_MONOTONIC);
+	tif_tsc.offset = ns - tif_tsc_to_ns(tsc);
+
+	min = -1;
+	for (int i = 0; i < TSC_OVERHEAD_LOOPS; i++) {
+		t = tif_tsc_start();
+		t = tif_tsc_stop() - t;
+		if (t < min)
+			min = t;
+	}
+	tif_tsc.overhead = min;
+
+	min = -1;
+	for (int i = 0; i < TSC_OVERHEAD_LOOPS; i++) {
+		asm volatile ("lfence":::"memory");
+		ns = get_time_ns(CLOCK_MONOTONIC);
+		asm volatile ("lfence":::"memory");
+		ns = get_time_ns(CLOCK_MONOTONIC) - ns;
+		asm volatile ("lfence":::"memory");
+		if ((uint64_t)ns < min)
+			min = ns;
+	}
+	tif_tsc.clock_overhead = min;
+
+	return 0;
 }
 
 /*******************************************************************
@@ -284,41 +1263,350 @@ int set_sched_fifo(int pid)
 	return sched_setscheduler(pid, SCHED_FIFO | SCHED_RESET_ON_FORK, &param);
 }
 
+/*******************************************************************
+ * Memory functions
+ *
+ * Page faults in the RT thread cause jitter. These functions are called
+ * before nohz entry so that the memory used by the RT thread is mapped
+ * and locked in advance. They make system calls and can schedule the
+ * thread out.
+ ******************************************************************/
+
 /*
- * Retrieves all CPUs listed as nohz_full
+ * Locks all current and future memory of the process and stops malloc
+ * from returning memory to the system or serving allocations with mmap,
+ * so that freed and reallocated memory stays mapped.
  *
- * Returns:
- * void* - pointer to object with cpu mask, NULL on error
+ * Returns 0 on success, -1 on error
+ */
+int tif_mem_lock(void)
+{
+	if (!mallopt(M_TRIM_THRESHOLD, -1) || !mallopt(M_MMAP_MAX, 0))
+		return -1;
+
+	return mlockall(MCL_CURRENT | MCL_FUTURE);
+}
+
+/*
+ * Touches size bytes of the calling thread's stack below the caller so
+ * that later calls up to that depth do not fault.
+ */
+__attribute__((noinline)) void tif_prefault_stack(size_t size)
+{
+	volatile char *p = alloca(size);
+	long page = sysconf(_SC_PAGESIZE);
+
+	for (size_t i = 0; i < size; i += page)
+		p[i] = 0;
+}
+
+/*
+ * Faults in and locks every page of a buffer without changing its
+ * contents
  *
+ * Returns 0 on success, -1 on error
  */
-static void *get_nohz_full_cpu_mask(void)
+int tif_prefault(void *buf, size_t size)
 {
-	FILE *fp;
-	char str[128];
-	void *p;
+	volatile char *p = buf;
+	long page = sysconf(_SC_PAGESIZE);
+
+	for (size_t i = 0; i < size; i += page)
+		p[i] = p[i];
+
+	if (size)
+		p[size - 1] = p[size - 1];
 
-	fp = fopen("/sys/devices/system/cpu/nohz_full", "rb");
-	if (!fp) {
-		printf("Kernel does not support NOHZ\n");
+	return mlock(buf, size);
+}
+
+static size_t mem_size(size_t size, int huge)
+{
+	size_t align = huge ? HUGE_PAGE_SIZE : (size_t)sysconf(_SC_PAGESIZE);
+
+	return (size + align - 1) & ~(align - 1);
+}
+
+/*
+ * Allocates a page aligned buffer that is faulted in and locked. With the
+ * default local allocation policy, pages are allocated in the NUMA node
+ * of the calling thread's CPU. If huge is set, the buffer is backed with
+ * huge pages from the hugetlb pool, or with transparent huge pages if the
+ * pool is empty.
+ *
+ * Returns pointer to zeroed buffer, NULL on error
+ */
+void *tif_mem_alloc(size_t size, int huge)
+{
+	int flags = MAP_PRIVATE | MAP_ANONYMOUS;
+	void *p = MAP_FAILED;
+
+	size = mem_size(size, huge);
+
+	if (huge)
+		p = mmap(NULL, size, PROT_READ | PROT_WRITE,
+				flags | MAP_HUGETLB | MAP_POPULATE, -1, 0);
+
+	if (p == MAP_FAILED) {
+		p = mmap(NULL, size, PROT_READ | PROT_WRITE, flags, -1, 0);
+		if (p == MAP_FAILED)
+			return NULL;
+
+		//Fault in after the advice so that THP is used
+		if (huge)
+			madvise(p, size, MADV_HUGEPAGE);
+	}
+
+	if (tif_prefault(p, size)) {
+		munmap(p, size);
 		return NULL;
 	}
 
-	p = fgets(str, 128, fp);
-	fclose(fp);
+	return p;
+}
 
-	if (!p || !*str || *str == '\n') {
-		printf("NOHZ cpu not found\n");
-		return NULL;
+/*
+ * Frees a buffer allocated by tif_mem_alloc() with the same size and huge
+ * arguments
+ */
+void tif_mem_free(void *buf, size_t size, int huge)
+{
+	if (buf)
+		munmap(buf, mem_size(size, huge));
+}
+
+/*******************************************************************
+ * CPU topology
+ ******************************************************************/
+#define SYS_CPU "/sys/devices/system/cpu"
+
+static struct tif_topology topology;
+static pthread_once_t topology_once = PTHREAD_ONCE_INIT;
+
+/*
+ * Reads a CPU list like "0,2-5" from the first line of file. If prefix
+ * is set, the list is taken from the space separated word in the line
+ * starting with prefix e.g. "rcu_nocbs=" in /proc/cmdline.
+ *
+ * Returns allocated mask, empty if file or list is not found
+ */
+static struct bitmask *read_cpu_list(const char *file, const char *prefix)
+{
+	struct bitmask *mask = NULL;
+	char *line = NULL, *str, *end;
+	size_t size = 0;
+	FILE *fp;
+
+	fp = fopen(file, "rb");
+	if (fp) {
+		if (getline(&line, &size, fp) != -1) {
+			str = line;
+			if (prefix) {
+				str = strstr(line, prefix);
+				while (str && str != line && !isspace(str[-1]))
+					str = strstr(str + 1, prefix);
+				if (str)
+					str += strlen(prefix);
+			}
+
+			if (str) {
+				end = str;
+				while (*end && !isspace(*end))
+					end++;
+				*end = 0;
+
+				//Kernels print "(null)" if list is empty
+				if (isdigit(*str))
+					mask = numa_parse_cpustring_all(str);
+			}
+		}
+		free(line);
+		fclose(fp);
 	}
 
-	strtok(str, "\n");
+	if (!mask)
+		mask = numa_allocate_cpumask();
 
-	p = numa_parse_cpustring_all(str);
+	return mask;
+}
 
-	if (!p)
-		printf("Error parsing NOHZ cpu list\n");
+/*
+ * Returns the first CPU in the list in file, -1 if not found
+ */
+static int read_first_cpu(const char *file)
+{
+	char str[16];
+	FILE *fp;
+	int cpu = -1;
 
-	return p;
+	fp = fopen(file, "rb");
+	if (fp) {
+		if (fgets(str, sizeof(str), fp) && isdigit(*str))
+			cpu = atoi(str);
+		fclose(fp);
+	}
+
+	return cpu;
+}
+
+/*
+ * Returns the first CPU sharing the last level cache with cpu, -1 if not
+ * found
+ */
+static int read_llc_id(int cpu)
+{
+	char path[128], type[32];
+	int level, max_level = 0, id = -1;
+	FILE *fp;
+
+	for (int i = 0; ; i++) {
+		snprintf(path, sizeof(path), SYS_CPU "/cpu%d/cache/index%d/type",
+				cpu, i);
+		fp = fopen(path, "rb");
+		if (!fp)
+			break;
+		if (!fgets(type, sizeof(type), fp))
+			*type = 0;
+		fclose(fp);
+
+		if (!memcmp(type, "Instruction", 11))
+			continue;
+
+		snprintf(path, sizeof(path), SYS_CPU "/cpu%d/cache/index%d/level",
+				cpu, i);
+		level = read_first_cpu(path);
+		if (level <= max_level)
+			continue;
+
+		snprintf(path, sizeof(path),
+				SYS_CPU "/cpu%d/cache/index%d/shared_cpu_list",
+				cpu, i);
+		id = read_first_cpu(path);
+		max_level = level;
+	}
+
+	return id;
+}
+
+static void init_topology(void)
+{
+	struct tif_topology *t = &topology;
+	char path[128];
+	int cpu, numa = numa_available() >= 0;
+
+	t->num_cpus = numa_num_possible_cpus();
+	t->online = read_cpu_list(SYS_CPU "/online", NULL);
+	t->nohz_full = read_cpu_list(SYS_CPU "/nohz_full", NULL);
+	t->isolcpus = read_cpu_list(SYS_CPU "/isolated", NULL);
+	t->rcu_nocbs = read_cpu_list("/proc/cmdline", "rcu_nocbs=");
+
+	t->core = calloc(t->num_cpus, sizeof(int));
+	t->llc = calloc(t->num_cpus, sizeof(int));
+	t->node = calloc(t->num_cpus, sizeof(int));
+	t->nohz_cpus = calloc(t->num_cpus, sizeof(int));
+	if (!t->core || !t->llc || !t->node || !t->nohz_cpus) {
+		t->num_cpus = 0;
+		return;
+	}
+
+	for (cpu = 0; cpu < t->num_cpus; cpu++) {
+		t->core[cpu] = t->llc[cpu] = t->node[cpu] = -1;
+
+		if (!numa_bitmask_isbitset(t->online, cpu))
+			continue;
+
+		snprintf(path, sizeof(path),
+				SYS_CPU "/cpu%d/topology/thread_siblings_list",
+				cpu);
+		t->core[cpu] = read_first_cpu(path);
+		t->llc[cpu] = read_llc_id(cpu);
+		//Kernels without NUMA support have no node to look up
+		if (numa)
+			t->node[cpu] = numa_node_of_cpu(cpu);
+
+		//CPU 0 is used for housekeeping
+		if (cpu && numa_bitmask_isbitset(t->nohz_full, cpu))
+			t->nohz_cpus[t->num_nohz++] = cpu;
+	}
+}
+
+/*
+ * Returns CPU topology read from sysfs on the first call. Later calls
+ * and the queries using it do not allocate memory or do file I/O and
+ * are safe to call from multiple threads. The returned object must not
+ * be modified or freed.
+ *
+ * Returns NULL if topology could not be read
+ */
+const struct tif_topology *tif_get_topology(void)
+{
+	pthread_once(&topology_once, init_topology);
+
+	return topology.num_cpus ? &topology : NULL;
+}
+
+/*
+ * Returns 1 if CPUs a and b are SMT siblings in the same core
+ */
+int tif_topo_same_core(int a, int b)
+{
+	const struct tif_topology *t = tif_get_topology();
+
+	if (!t || a < 0 || b < 0 || a >= t->num_cpus || b >= t->num_cpus)
+		return 0;
+
+	return t->core[a] != -1 && t->core[a] == t->core[b];
+}
+
+/*
+ * Returns 1 if CPUs a and b share the last level cache
+ */
+int tif_topo_same_llc(int a, int b)
+{
+	const struct tif_topology *t = tif_get_topology();
+
+	if (!t || a < 0 || b < 0 || a >= t->num_cpus || b >= t->num_cpus)
+		return 0;
+
+	return t->llc[a] != -1 && t->llc[a] == t->llc[b];
+}
+
+/*
+ * Returns NUMA node of cpu, -1 if not known
+ */
+int tif_topo_node(int cpu)
+{
+	const struct tif_topology *t = tif_get_topology();
+
+	if (!t || cpu < 0 || cpu >= t->num_cpus)
+		return -1;
+
+	return t->node[cpu];
+}
+
+/*
+ * Retrieves all CPUs listed as nohz_full
+ *
+ * Caller must free the returned mask with numa_bitmask_free()
+ *
+ * Returns:
+ * struct bitmask* - pointer to object with cpu mask, NULL on error or
+ * if there are no nohz_full CPUs
+ *
+ */
+struct bitmask *get_nohz_full_cpu_mask(void)
+{
+	const struct tif_topology *t = tif_get_topology();
+	struct bitmask *mask;
+
+	if (!t || !numa_bitmask_weight(t->nohz_full))
+		return NULL;
+
+	mask = numa_allocate_cpumask();
+	if (mask)
+		copy_bitmask_to_bitmask(t->nohz_full, mask);
+
+	return mask;
 }
 
 /*
@@ -330,41 +1618,26 @@ static void *get_nohz_full_cpu_mask(void)
  */
 int is_nohz_cpu(int cpu)
 {
-	struct bitmask *c = get_nohz_full_cpu_mask();
+	const struct tif_topology *t = tif_get_topology();
 
-	if (c && cpu && numa_bitmask_isbitset(c, cpu)) {
-		numa_bitmask_free(c);
-		return 1;
-	}
+	if (!t || cpu <= 0 || cpu >= t->num_cpus)
+		return 0;
 
-	return 0;
+	return numa_bitmask_isbitset(t->nohz_full, cpu);
 }
 
 /*
- * Finds the first nohz_full CPU.
+ * Finds the first nohz_full CPU other than CPU 0.
  *
  * Returns nohz_full CPU if found, -1 if none found
  *
  */
 int get_nohz_full_cpu(void)
 {
-	FILE *fp;
-	char str[128];
-	int c;
-	char *ret;
-
-	fp = fopen("/sys/devices/system/cpu/nohz_full", "rb");
-	if (fp) {
-		ret = fgets(str, 128, fp);
-
-		fclose(fp);
+	const struct tif_topology *t = tif_get_topology();
 
-		if (ret) {
-			c = atoi(str);
-			if (c)
-				return c;
-		}
-	}
+	if (!t || !t->num_nohz)
+		return -1;
 
-	return -1;
+	return t->nohz_cpus[0];
 }
@@ -13,13 +13,171 @@
 #ifndef _TIF_HELPER_H
 #define _TIF_HELPER_H
 
+#include <stdint.h>
+#include <stddef.h>
+#include <x86intrin.h>
+
+struct bitmask;
+
+//Methods to check tick stopped state used by nohz_tick_stopped()
+#define TICK_CHECK_FAST 0 //Reads only the CPU's section of timer_list
+#define TICK_CHECK_FULL 1 //Parses the whole timer_list
+
+/*
+ * Error codes returned by the context API. nohz_wait() returns
+ * TIF_ERR_TIMEOUT and TIF_ERR_NO_NOHZ as well.
+ */
+#define TIF_ERR_TIMEOUT -1 //nohz state not entered within wait time
+#define TIF_ERR_NO_NOHZ -2 //Kernel does not support nohz
+#define TIF_ERR_SYS -3 //System call failed, errno is set
+#define TIF_ERR_INVAL -4 //Invalid argument
+#define TIF_ERR_NOMEM -5 //Out of memory
+#define TIF_ERR_STATE -6 //Exit without session or enter while in one
+
+//Default wait times for nohz entry used by tif_thread_enter()
+#define TIF_WAIT_US 5000
+#define TIF_FORCED_WAIT_US 5000000
+
+/*
+ * Thread safe context API. Each RT thread calls tif_thread_enter() to
+ * start its isolation session and tif_thread_exit() to end it. The system
+ * wide scheduler runtime setting is changed by the first session in the
+ * process and reverted when the last one ends.
+ */
+struct tif_ctx;
+
+struct tif_ctx *tif_ctx_create(void);
+int tif_ctx_destroy(struct tif_ctx *ctx);
+void tif_ctx_set_wait(struct tif_ctx *ctx, long wait_us, long forced_wait_us);
+int tif_thread_enter(struct tif_ctx *ctx, int cpu);
+int tif_thread_exit(struct tif_ctx *ctx);
+const char *tif_strerror(int err);
+
+/*
+ * System settings changed by TIF are saved in this file until restored,
+ * so that they can be restored after the process is killed. Can be
+ * changed with tif_state_set_file().
+ */
+#define TIF_STATE_FILE "/run/tif.state"
+
+int tif_state_set_file(const char *file);
+const char *tif_state_file(void);
+int tif_state_save(const char *path);
+int tif_state_restore(void);
+int tif_state_restore_on_signal(void);
+
 long nohz_wait(long msecs, int forced);
 int nohz_enter(void);
-void nohz_exit(void);
+int nohz_enter_async(void);
+int nohz_enter_wait(void);
+int nohz_exit(void);
+int nohz_tick_stopped(int cpu, int method);
 
 int set_sched_fifo(int pid);
 int set_cpu_affinity(int cpu, int pid);
+
+/*
+ * Memory locking and pre-faulting. Called before nohz_wait() as they
+ * make system calls.
+ */
+int tif_mem_lock(void);
+void tif_prefault_stack(size_t size);
+int tif_prefault(void *buf, size_t size);
+void *tif_mem_alloc(size_t size, int huge);
+void tif_mem_free(void *buf, size_t size, int huge);
 int get_nohz_full_cpu(void);
 int is_nohz_cpu(int cpu);
+struct bitmask *get_nohz_full_cpu_mask(void);
+
+/*
+ * CPU topology read once from sysfs. Per CPU arrays are indexed by CPU
+ * number and have num_cpus entries. Entries of offline CPUs are -1.
+ */
+struct tif_topology {
+	int num_cpus; //Possible CPUs
+	struct bitmask *online;
+	struct bitmask *nohz_full;
+	struct bitmask *isolcpus;
+	struct bitmask *rcu_nocbs;
+	int *core; //First SMT sibling of the core
+	int *llc; //First CPU sharing the last level cache
+	int *node; //NUMA node
+	int *nohz_cpus; //nohz_full CPUs other than CPU 0
+	int num_nohz;
+};
+
+const struct tif_topology *tif_get_topology(void);
+int tif_topo_same_core(int a, int b);
+int tif_topo_same_llc(int a, int b);
+int tif_topo_node(int cpu);
+
+/*
+ * Calibrated TSC based timing. tif_tsc_init() must be called once before
+ * use. Time a section with tif_tsc_start() and tif_tsc_stop(), subtract
+ * overhead and convert to nanoseconds with tif_tsc_to_ns(). Conversion
+ * is done in user space and does not read the kernel's timekeeping
+ * (vvar) page like clock_gettime() does.
+ */
+#define TSC_SRC_CALIBRATED 0 //mult/shift from calibration
+#define TSC_SRC_KERNEL 1 //mult/shift from kernel via perf mmap page
+
+struct tif_tsc {
+	uint64_t hz; //TSC frequency
+	uint64_t mult; //ns = ticks * mult >> shift
+	uint32_t shift;
+	int source; //TSC_SRC_*
+	int invariant; //1 if TSC rate is constant across P/C states
+	int64_t offset; //CLOCK_MONOTONIC ns = tif_tsc_to_ns(ticks) + offset
+	uint64_t overhead; //Ticks taken by a start/stop pair
+	uint64_t clock_overhead; //ns taken by a fenced clock_gettime pair
+};
+
+extern struct tif_tsc tif_tsc;
+
+int tif_tsc_init(void);
+int64_t tif_tsc_drift(void);
+
+static inline uint64_t tif_tsc_start(void)
+{
+	uint64_t t;
+
+	//Earlier instructions complete before and later ones start after
+	asm volatile ("lfence":::"memory");
+	t = __rdtsc();
+	asm volatile ("lfence":::"memory");
+
+	return t;
+}
+
+static inline uint64_t tif_tsc_stop(void)
+{
+	unsigned int tsc_aux;
+	uint64_t t;
+
+	//rdtscp waits for earlier instructions to complete
+	t = __rdtscp(&tsc_aux);
+	asm volatile ("lfence":::"memory");
+
+	return t;
+}
+
+static inline uint64_t tif_tsc_to_ns(uint64_t ticks)
+{
+	return ((unsigned __int128)ticks * tif_tsc.mult) >> tif_tsc.shift;
+}
+
+//Converts TSC ticks to CLOCK_MONOTONIC nanoseconds
+static inline int64_t tif_tsc_to_mono(uint64_t ticks)
+{
+	return tif_tsc_to_ns(ticks) + tif_tsc.offset;
+}
+
+//Returns ticks between start and stop excluding timer overhead
+static inline uint64_t tif_tsc_elapsed(uint64_t start, uint64_t stop)
+{
+	uint64_t d = stop - start;
+
+	return d > tif_tsc.overhead ? d - tif_tsc.overhead : 0;
+}
 
 #endif //#ifndef _TIF_HELPER_H
@@ -0,0 +1,145 @@
+//SPDX-License-Identifier: GPL-2.0-or-later
+/*
+ * Copyright (C) 2020 Intel Corporation
+ *
+ * Log-linear latency histogram used to compute percentiles
+ *
+ */
+
+#include <string.h>
+#include "tif_hist.h"
+
+void tif_hist_reset(struct tif_hist *h)
+{
+	memset(h, 0, sizeof(*h));
+}
+
+/*
+ * Adds counts of src to dst. src can be concurrently updated by its
+ * owning thread. The total count of dst is taken from the buckets so
+ * that it is consistent with them.
+ */
+void tif_hist_merge(struct tif_hist *dst, const struct tif_hist *src)
+{
+	uint64_t c, min, max;
+
+	if (!__atomic_load_n(&src->count, __ATOMIC_ACQUIRE))
+		return;
+
+	min = __atomic_load_n(&src->min, __ATOMIC_RELAXED);
+	max = __atomic_load_n(&src->max, __ATOMIC_RELAXED);
+
+	if (!dst->count || min < dst->min)
+		dst->min = min;
+	if (max > dst->max)
+		dst->max = max;
+
+	for (int i = 0; i < HIST_BUCKETS; i++) {
+		c = __atomic_load_n(&src->counts[i], __ATOMIC_RELAXED);
+		dst->counts[i] += c;
+		dst->count += c;
+	}
+}
+
+/*
+ * Returns the lowest value counted in the bucket at index
+ */
+uint64_t tif_hist_bucket_low(int index)
+{
+	int shift;
+
+	if (index < HIST_SUB_COUNT)
+		return index;
+
+	index -= HIST_SUB_COUNT;
+	shift = index / HIST_SUB_HALF + 1;
+
+	return (uint64_t)(index % HIST_SUB_HALF + HIST_SUB_HALF) << shift;
+}
+
+/*
+ * Returns the highest value counted in the bucket at index
+ */
+uint64_t tif_hist_bucket_high(int index)
+{
+	if (index < HIST_SUB_COUNT)
+		return index;
+
+	return tif_hist_bucket_low(index) +
+		(1ULL << ((index - HIST_SUB_COUNT) / HIST_SUB_HALF + 1)) - 1;
+}
+
+/*
+ * Returns the value of the sample at the given rank (1 = smallest) as
+ * the highest value of its bucket, limited to the recorded min and max.
+ * Returns 0 if histogram is empty.
+ */
+uint64_t tif_hist_value_at_rank(const struct tif_hist *h, uint64_t rank)
+{
+	uint64_t sum = 0, v;
+	int i;
+
+	if (!h->count)
+		return 0;
+
+	if (rank < 1)
+		rank = 1;
+	if (rank > h->count)
+		rank = h->count;
+
+	for (i = 0; i < HIST_BUCKETS; i++) {
+		sum += h->counts[i];
+		if (sum >= rank)
+			break;
+	}
+
+	v = tif_hist_bucket_high(i);
+	if (v > h->max)
+		v = h->max;
+	if (v < h->min)
+		v = h->min;
+
+	return v;
+}
+
+/*
+ * Returns the value below or equal to which pct percent of the samples
+ * fall. Returns 0 if histogram is empty.
+ */
+uint64_t tif_hist_percentile(const struct tif_hist *h, double pct)
+{
+	uint64_t rank;
+
+	//Round up so that e.g. p99.99 of 100 samples is the max
+	rank = (uint64_t)(h->count * pct / 100.0);
+	if ((double)rank < h->count * pct / 100.0)
+		rank++;
+
+	return tif_hist_value_at_rank(h, rank);
+}
+
+/*
+ * Writes non empty buckets as lines of lowest value, highest value and
+ * count, preceded by a header line with the name and summary.
+ *
+ * Returns 0 on success, -1 on error
+ */
+int tif_hist_write(const struct tif_hist *h, const char *name, FILE *fp)
+{
+	fprintf(fp, "# %s samples %lu min %lu max %lu p50 %lu p99 %lu"
+			" p99.9 %lu p99.99 %lu\n", name, h->count, h->min, h->max,
+			tif_hist_percentile(h, 50), tif_hist_percentile(h, 99),
+			tif_hist_percentile(h, 99.9),
+			tif_hist_percentile(h, 99.99));
+
+	for (int i = 0; i < HIST_BUCKETS; i++) {
+		if (!h->counts[i])
+			continue;
+
+		fprintf(fp, "%lu %lu %lu\n",
+				tif_hist_bucket_low(i), tif_hist_bucket_high(i),
+				h->counts[i]);
+	}
+
+	return ferror(fp) ? -1 : 0;
+}
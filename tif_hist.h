@@ -0,0 +1,74 @@
+//SPDX-License-Identifier: GPL-2.0-or-later
+/*
+ * Copyright (C) 2020 Intel Corporation
+ *
+ * Fixed size log-linear latency histogram. Values below HIST_SUB_COUNT
+ * are counted exactly. Above that, every power of 2 range is split into
+ * HIST_SUB_COUNT / 2 linear buckets which keeps the relative error under
+ * 2 / HIST_SUB_COUNT over the whole 64 bit range.
+ *
+ * Recording does not allocate memory or make system calls and can be
+ * done from RT threads. Histograms of multiple threads can be merged.
+ *
+ */
+
+#ifndef _TIF_HIST_H
+#define _TIF_HIST_H
+
+#include <stdio.h>
+#include <stdint.h>
+
+#define HIST_SUB_BITS 7
+#define HIST_SUB_COUNT (1 << HIST_SUB_BITS)
+#define HIST_SUB_HALF (HIST_SUB_COUNT / 2)
+#define HIST_BUCKETS (HIST_SUB_COUNT + (64 - HIST_SUB_BITS) * HIST_SUB_HALF)
+
+struct tif_hist {
+	uint64_t count;
+	uint64_t min;
+	uint64_t max;
+	uint64_t counts[HIST_BUCKETS];
+};
+
+static inline int tif_hist_index(uint64_t v)
+{
+	int shift;
+
+	if (v < HIST_SUB_COUNT)
+		return v;
+
+	//Shift that brings v to the range HIST_SUB_HALF - HIST_SUB_COUNT-1
+	shift = 63 - __builtin_clzll(v) - (HIST_SUB_BITS - 1);
+
+	return HIST_SUB_COUNT + (shift - 1) * HIST_SUB_HALF +
+		(v >> shift) - HIST_SUB_HALF;
+}
+
+/*
+ * Records a value. Must be called only by the thread owning the
+ * histogram. Other threads can read it concurrently with
+ * tif_hist_merge() and get a slightly stale but valid view.
+ */
+static inline void tif_hist_record(struct tif_hist *h, uint64_t v)
+{
+	int i = tif_hist_index(v);
+
+	__atomic_store_n(&h->counts[i], h->counts[i] + 1, __ATOMIC_RELAXED);
+
+	if (!h->count || v < h->min)
+		__atomic_store_n(&h->min, v, __ATOMIC_RELAXED);
+	if (v > h->max)
+		__atomic_store_n(&h->max, v, __ATOMIC_RELAXED);
+
+	__atomic_store_n(&h->count, h->count + 1, __ATOMIC_RELEASE);
+}
+
+void tif_hist_reset(struct tif_hist *h);
+void tif_hist_merge(struct tif_hist *dst, const struct tif_hist *src);
+uint64_t tif_hist_bucket_low(int index);
+uint64_t tif_hist_bucket_high(int index);
+uint64_t tif_hist_value_at_rank(const struct tif_hist *h, uint64_t rank);
+uint64_t tif_hist_percentile(const struct tif_hist *h, double pct);
+int tif_hist_write(const struct tif_hist *h, const char *name, FILE *fp);
+
+#endif //#ifndef _TIF_HIST_H
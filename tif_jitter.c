@@ -13,6 +13,8 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <errno.h>
+#include <math.h>
 #include <signal.h>
 #include <inttypes.h>
 #include <x86intrin.h>
@@ -20,46 +22,209 @@
 #include <pthread.h>
 #include <sys/types.h>
 #include <unistd.h>
+#include <sys/syscall.h>
+#include <numa.h>
 #include "tif_helper.h"
-
-void nohz_workload(void);
+#include "tif_ring.h"
+#include "tif_hist.h"
+#include "tif_capture.h"
+#include "tif_workload.h"
+#include "tif_preflight.h"
+#include "tif_attrib.h"
+#include "tif_pmu.h"
+#include "tif_report.h"
 
 #define PRINT_INFO 1
 
 #define NUM_TESTS 1000 //Default number of tests
 #define NUM_LOOPS 1000 //Default number of times workload is run per test
 #define HIST_FILE "nohz.hist" //Default histogram file
+#define MAX_CPUS 256 //Max number of NOHZ CPUs measured together
+#define RING_SIZE 1024 //Results buffered per persistent RT thread
+#define POLL_US 1000 //Main thread poll interval for persistent RT threads
+#define SWEEP_MIN_SIZE 4096 //First working set size of sweep
+#define SWEEP_LLC_MULT 4 //Sweep up to this multiple of LLC size
+#define SWEEP_MAX_SIZE (256 << 20) //Sweep end if LLC size is unknown
+#define ATTRIB_BUCKETS 65 //Power of 2 test jitter ranges of cause breakdown
+#define ATTRIB_POLL_US 50 //Main thread poll interval around attributed tests
+#define PMU_BUCKETS 65 //Power of 2 loop duration ranges of counter breakdown
+#define CI_Z 1.96 //Standard deviations of 95% confidence interval
+#define CI_WIDTH 5.0 //Default target confidence interval width in %
+#define CI_MAX_TESTS 100000 //Default max tests with -q and no duration
+#define OUT_FILE "nohz" //Default structured output file, format is extension
+#define OUT_JSON 1
+#define OUT_CSV 2
 
 //Global options set by command line arguments
 int use_tsc;
 int num_tests = NUM_TESTS;
+int tests_set; //-t given
 int num_loops = NUM_LOOPS;
-int nohz_cpu;
+int nohz_cpus[MAX_CPUS];
+int num_cpus;
 int duration;
+int persistent;
+int sweep;
 int hist;
 FILE *hist_fd;
-
-uint64_t cmax, cmin = -1, avg;
-uint64_t cstart, cend;
+char *capture_file;
+const struct tif_workload *workload;
+char *workload_arg;
+int restore_state;
+int audit;
+int tune;
+char *cpu_list;
+char *pipe_list; //Ordered CPU list of pipeline stages
+size_t prefault_stack; //Bytes of RT thread stack to pre-fault, 0 = no locking
+int huge_pages;
+int attrib;
+int pmu;
+uint64_t noise_threshold; //Gap in ns recorded by noise mode, 0 = workload mode
+int pipeline; //RT threads are stages of a pipeline in nohz_cpus order
+unsigned int period_hz; //Cycle rate of periodic mode, 0 = back to back
+double ci_pct; //Percentile of adaptive stopping, 0 = off
+double ci_target = CI_WIDTH; //Confidence interval width to stop at, in %
+int out_format; //OUT_JSON or OUT_CSV, 0 = none
+char *out_file;
+char out_name[16];
+FILE *out_fd;
+char options[1024]; //Command line options of the run
+struct tif_meta meta;
 
 int tests_done;
 
+//Running jitter statistics of a CPU or of all CPUs together
+struct jitter_stats {
+	uint64_t max;
+	uint64_t min;
+	uint64_t sum;
+	unsigned int count;
+};
+
+//Interrupts, softirqs and context switches of tests in a jitter range
+struct attrib_bucket {
+	uint64_t tests;
+	struct tif_attrib causes;
+};
+
+//Hardware counters of loops in a duration range
+struct pmu_bucket {
+	uint64_t loops;
+	struct tif_pmu_count counts;
+};
+
+//Handed from each pipeline stage to the next, one per cache line
+struct pipe_token {
+	uint64_t seq;
+	uint64_t start; //TSC when the first stage started it
+	uint64_t sent; //TSC when pushed to the ring of the next stage
+} __attribute__((aligned(TIF_CACHE_LINE)));
+
+//Result of a test passed from persistent RT thread to main thread
+struct test_result {
+	uint64_t jitter;
+};
+
 struct thread_data {
+	pthread_t tid;
 	uint64_t jitter;
 	int cpu;
 	int ret;
+	struct jitter_stats stats;
+	struct tif_hist *hist; //Durations of every workload loop
+	struct tif_capture *cap; //Raw samples, NULL if not captured
+	void *wl_ctx; //Workload context of this CPU
+	int wl_ready;
+
+	//Used by persistent RT threads
+	struct tif_ring ring;
+	int done;
+
+	//Used for jitter attribution
+	int ktid; //Kernel thread id
+	int measured; //Test done, waiting for release by main thread
+	int release;
+	struct attrib_bucket *causes; //By power of 2 range of test jitter
+	struct tif_attrib worst_causes; //Of the test with the highest jitter
+	uint64_t worst;
+
+	//Used for hardware counters
+	struct tif_pmu pmu;
+	int pmu_open;
+	struct pmu_bucket *loop_counts; //By power of 2 range of loop duration
+	struct tif_pmu_count slowest_counts; //Of the slowest loop
+	uint64_t slowest;
+	struct tif_smi smi_count; //Read by main thread around tests
+	uint64_t smi_last; //Count at the last read
+	uint64_t smi; //SMIs during the test
+	uint64_t smi_total;
+	uint64_t smi_tests; //Tests with SMIs
+	uint64_t smi_worst; //Highest jitter of tests with SMIs
+	uint64_t clean_worst; //Highest jitter of tests without SMIs
+
+	//Used in noise mode
+	uint64_t gaps; //Gaps above threshold
+	uint64_t noise; //Total ns of those gaps
+
+	//Used in periodic mode
+	struct jitter_stats compute; //Workload time of each cycle
+	uint64_t misses; //Deadlines missed
 };
 
-static inline uint64_t get_time(void)
+struct thread_data td[MAX_CPUS];
+struct jitter_stats total_stats;
+struct tif_hist total_hist;
+struct tif_capture *captures;
+
+//Number of RT threads that are in nohz state and ready to measure
+static int threads_ready;
+
+//Set by main thread to stop persistent RT threads
+static int stop_workers;
+
+//Set when the main thread reads counters right before and after each test
+//of the RT threads created for it
+static int sync_tests;
+
+//Set by main thread to start a test once counters are read
+static int attrib_go;
+struct tif_attrib attrib_prev[MAX_CPUS];
+struct tif_attrib attrib_cur[MAX_CPUS];
+
+//Counters found available when probed from the main thread
+static int pmu_avail[PMU_EVENTS];
+static int pmu_counters;
+static int smi_avail;
+
+//Confidence interval of ci_pct after the last test
+static struct {
+	uint64_t est;
+	uint64_t low;
+	uint64_t high;
+	double width; //% of est, -1 if too few samples
+	int reached;
+} ci = { .width = -1 };
+
+//Noise mode threshold and test length in TSC ticks
+static uint64_t noise_ticks;
+static uint64_t noise_window;
+
+//Periodic mode cycle length in TSC ticks
+static uint64_t period_ticks;
+
+//Ring from each pipeline stage to the next
+static struct tif_ring pipe_rings[MAX_CPUS];
+
+//Tokens completed by the last stage and end to end jitter of the test
+static uint64_t pipe_done __attribute__((aligned(TIF_CACHE_LINE)));
+static uint64_t pipe_jitter;
+
+static inline uint64_t get_time_start(void)
 {
 	uint64_t retval;
 
 	if (use_tsc) {
-		unsigned int tsc_aux;
-
-		asm volatile ("lfence":::"memory");
-		retval = __rdtscp(&tsc_aux);
-		asm volatile ("lfence":::"memory");
+		retval = tif_tsc_start();
 	} else {
 		struct timespec time;
 
@@ -73,46 +238,635 @@ static inline uint64_t get_time(void)
 	return retval;
 }
 
-static inline void print_jitter(uint64_t jitter)
+static inline uint64_t get_time_stop(void)
+{
+	if (use_tsc)
+		return tif_tsc_stop();
+
+	return get_time_start();
+}
+
+/*
+ * Returns nanoseconds between start and end excluding the overhead of
+ * reading the time
+ */
+static inline uint64_t get_elapsed(uint64_t start, uint64_t end)
+{
+	uint64_t diff;
+
+	if (use_tsc)
+		return tif_tsc_to_ns(tif_tsc_elapsed(start, end));
+
+	diff = end - start;
+
+	return diff > tif_tsc.clock_overhead ? diff - tif_tsc.clock_overhead : 0;
+}
+
+static inline int print_rows(void)
+{
+	//Rows of CPUs, aggregate and percentiles
+	return (num_cpus > 1 ? num_cpus + 1 : num_cpus) + 1;
+}
+
+/*
+ * Merges the loop duration histograms of all CPUs into total_hist. In
+ * pipeline mode total_hist is the end to end latency.
+ */
+static void merge_hist(void)
+{
+	tif_hist_reset(&total_hist);
+
+	//Stage histograms are of different hops, show end to end
+	if (pipeline) {
+		if (td[0].hist)
+			tif_hist_merge(&total_hist, td[0].hist);
+		return;
+	}
+
+	for (int i = 0; i < num_cpus; i++)
+		if (td[i].hist)
+			tif_hist_merge(&total_hist, td[i].hist);
+}
+
+static void update_stats(struct jitter_stats *st, uint64_t jitter)
+{
+	if (!st->count || jitter > st->max)
+		st->max = jitter;
+	if (!st->count || jitter < st->min)
+		st->min = jitter;
+	st->sum += jitter;
+	st->count++;
+}
+
+static inline void print_stats_row(const char *cpu, uint64_t jitter,
+		struct jitter_stats *st)
+{
+	printf("%10u %6s %10lu %10lu %10lu %10lu\n",
+			tests_done, cpu, jitter, st->max, st->min,
+			st->sum/st->count);
+}
+
+/*
+ * Prints one row per CPU followed by an aggregate row when more than one
+ * CPU is measured. The aggregate row shows the worst jitter of the test
+ * across all CPUs. Last row shows percentiles of the duration of every
+ * workload loop run so far on all CPUs. Cursor is moved back up so that
+ * rows are rewritten in place on the next test.
+ */
+static inline void print_jitter(uint64_t worst)
 {
 	static int once;
+	char cpu[16];
+	int i;
 
 	if (!once) {
-		printf("                (Jitter in %s)\n",
-				use_tsc ? "TSC ticks" : "nanoseconds");
-		printf("     Test#     Jitter        Max        Min");
+		printf("                       (Jitter in nanoseconds)\n");
+		printf("     Test#    CPU     Jitter        Max        Min");
 		printf("       Mean\n");
-		printf("-------------------------------------------");
+		printf("--------------------------------------------------");
 		printf("------------\n");
 		once = 1;
 	}
-	printf("%10u %10lu %10lu %10lu %10lu\n\033[1A",
-			tests_done, jitter, cmax, cmin, avg/tests_done);
+
+	for (i = 0; i < num_cpus; i++) {
+		snprintf(cpu, sizeof(cpu), "%d", td[i].cpu);
+		print_stats_row(cpu, td[i].jitter, &td[i].stats);
+	}
+
+	if (num_cpus > 1)
+		print_stats_row("all", worst, &total_stats);
+
+	merge_hist();
+	printf("%s p50 %lu p99 %lu p99.9 %lu p99.99 %lu max %lu",
+			noise_threshold ? "Gap" : pipeline ? "E2E" :
+			period_hz ? "Late" : "Loop",
+			tif_hist_percentile(&total_hist, 50),
+			tif_hist_percentile(&total_hist, 99),
+			tif_hist_percentile(&total_hist, 99.9),
+			tif_hist_percentile(&total_hist, 99.99),
+			total_hist.max);
+	if (ci_pct && ci.width >= 0)
+		printf(" p%g CI %.2f%%", ci_pct, ci.width);
+	printf("\033[K\n");
+
+	printf("\033[%dA", print_rows());
+}
+
+/*
+ * Writes the loop duration histogram of each CPU, if more than one,
+ * followed by that of all CPUs to the histogram file. In pipeline mode
+ * writes the histogram of each hop followed by end to end latency.
+ */
+static void write_hist(void)
+{
+	char name[32];
+
+	if (pipeline) {
+		for (int i = 1; i < num_cpus && td[i].hist; i++) {
+			snprintf(name, sizeof(name), "hop %d->%d",
+					td[i - 1].cpu, td[i].cpu);
+			tif_hist_write(td[i].hist, name, hist_fd);
+		}
+		tif_hist_write(td[0].hist, "end to end", hist_fd);
+		return;
+	}
+
+	if (num_cpus > 1) {
+		for (int i = 0; i < num_cpus && td[i].hist; i++) {
+			snprintf(name, sizeof(name), "cpu %d", td[i].cpu);
+			tif_hist_write(td[i].hist, name, hist_fd);
+		}
+	}
+
+	merge_hist();
+	tif_hist_write(&total_hist, "all", hist_fd);
+}
+
+/*
+ * Writes the cause breakdown of each CPU as lines of test jitter range,
+ * number of tests and the total count of each cause in those tests
+ */
+static void write_causes(void)
+{
+	uint64_t low;
+
+	for (int i = 0; i < num_cpus; i++) {
+		fprintf(hist_fd, "# cpu %d causes\n# low high tests", td[i].cpu);
+		for (int c = 0; c < ATTRIB_NUM; c++)
+			fprintf(hist_fd, " %s", tif_attrib_names[c]);
+		fprintf(hist_fd, "\n");
+
+		for (int b = 0; b < ATTRIB_BUCKETS; b++) {
+			if (!td[i].causes[b].tests)
+				continue;
+
+			low = b ? 1ULL << (b - 1) : 0;
+			fprintf(hist_fd, "%lu %lu %lu", low, b ? low * 2 - 1 : 0,
+					td[i].causes[b].tests);
+			for (int c = 0; c < ATTRIB_NUM; c++)
+				fprintf(hist_fd, " %lu",
+						td[i].causes[b].causes.v[c]);
+			fprintf(hist_fd, "\n");
+		}
+	}
+}
+
+/*
+ * Writes the hardware counter breakdown of each CPU as lines of loop
+ * duration range, number of loops and the total of each counter in those
+ * loops
+ */
+static void write_counters(void)
+{
+	uint64_t low;
+
+	for (int i = 0; i < num_cpus; i++) {
+		if (persistent)
+			fprintf(hist_fd, "# cpu %d counters, %lu SMIs in the run\n",
+					td[i].cpu, td[i].smi_total);
+		else
+			fprintf(hist_fd, "# cpu %d counters, %lu SMIs in %lu tests\n",
+					td[i].cpu, td[i].smi_total, td[i].smi_tests);
+		fprintf(hist_fd, "# low high loops");
+		for (int c = 0; c < PMU_EVENTS; c++)
+			fprintf(hist_fd, " %s", tif_pmu_names[c]);
+		fprintf(hist_fd, "\n");
+
+		for (int b = 0; b < PMU_BUCKETS; b++) {
+			if (!td[i].loop_counts[b].loops)
+				continue;
+
+			low = b ? 1ULL << (b - 1) : 0;
+			fprintf(hist_fd, "%lu %lu %lu", low, b ? low * 2 - 1 : 0,
+					td[i].loop_counts[b].loops);
+			for (int c = 0; c < PMU_EVENTS; c++)
+				fprintf(hist_fd, " %lu",
+						td[i].loop_counts[b].counts.v[c]);
+			fprintf(hist_fd, "\n");
+		}
+	}
+}
+
+/*
+ * Prints the counters of the slowest loop of each CPU next to the mean of
+ * all loops, and the worst jitter of tests with and without SMIs
+ */
+static void print_counters(void)
+{
+	struct tif_pmu_count sum;
+	uint64_t loops;
+
+	for (int i = 0; i < num_cpus; i++) {
+		memset(&sum, 0, sizeof(sum));
+		loops = 0;
+		for (int b = 0; b < PMU_BUCKETS; b++) {
+			loops += td[i].loop_counts[b].loops;
+			for (int c = 0; c < PMU_EVENTS; c++)
+				sum.v[c] += td[i].loop_counts[b].counts.v[c];
+		}
+
+		printf("CPU %d slowest loop %luns:", td[i].cpu, td[i].slowest);
+		for (int c = 0; c < PMU_EVENTS; c++)
+			if (pmu_avail[c])
+				printf(" %s %lu (mean %lu)", tif_pmu_names[c],
+						td[i].slowest_counts.v[c],
+						loops ? sum.v[c] / loops : 0);
+		printf("\n");
+
+		if (smi_avail && persistent)
+			printf("CPU %d SMIs %lu in the run\n", td[i].cpu,
+					td[i].smi_total);
+		else if (smi_avail)
+			printf("CPU %d SMIs %lu in %lu tests, worst jitter %luns "
+					"with SMIs, %luns without\n", td[i].cpu,
+					td[i].smi_total, td[i].smi_tests,
+					td[i].smi_worst, td[i].clean_worst);
+	}
+}
+
+static void close_smi(void)
+{
+	for (int i = 0; i < num_cpus; i++)
+		tif_smi_close(&td[i].smi_count);
+}
+
+//Returns how the caches of two CPUs are shared
+static const char *placement(int a, int b)
+{
+	if (tif_topo_same_core(a, b))
+		return "SMT siblings";
+	if (tif_topo_same_llc(a, b))
+		return "same LLC";
+	//Nodes are not known on kernels without NUMA support
+	if (tif_topo_node(a) == -1 || tif_topo_node(b) == -1)
+		return "other LLC";
+	if (tif_topo_node(a) == tif_topo_node(b))
+		return "same node";
+
+	return "cross node";
+}
+
+static void print_pipe_row(const char *name, const struct tif_hist *h)
+{
+	printf("%-32s p50 %lu p99 %lu p99.9 %lu max %lu\n", name,
+			tif_hist_percentile(h, 50), tif_hist_percentile(h, 99),
+			tif_hist_percentile(h, 99.9), h->max);
+}
+
+/*
+ * Prints latency percentiles of each hop with the placement of its CPUs
+ * followed by end to end latency
+ */
+static void print_pipeline(void)
+{
+	char name[64];
+
+	for (int i = 1; i < num_cpus; i++) {
+		snprintf(name, sizeof(name), "Hop %d->%d (%s)", td[i - 1].cpu,
+				td[i].cpu, placement(td[i - 1].cpu, td[i].cpu));
+		print_pipe_row(name, td[i].hist);
+	}
+	print_pipe_row("End to end", td[0].hist);
+}
+
+/*
+ * Prints the confidence interval achieved by adaptive stopping
+ */
+static void print_ci(void)
+{
+	if (ci.width < 0) {
+		printf("p%g: too few samples for a 95%% confidence interval\n",
+				ci_pct);
+		return;
+	}
+
+	printf("p%g %luns, 95%% CI %lu-%luns, width %.2f%% (target %g%%) %s\n",
+			ci_pct, ci.est, ci.low, ci.high, ci.width, ci_target,
+			ci.reached ? "reached" : "not reached");
+}
+
+/*
+ * Prints workload time and deadline misses of each CPU
+ */
+static void print_periodic(void)
+{
+	struct jitter_stats *c;
+
+	for (int i = 0; i < num_cpus; i++) {
+		c = &td[i].compute;
+		printf("CPU %d compute max %luns min %luns mean %luns, "
+				"%lu deadlines missed in %u cycles\n",
+				td[i].cpu, c->max, c->min,
+				c->count ? c->sum / c->count : 0,
+				td[i].misses, c->count);
+	}
+}
+
+/*
+ * Prints the gaps of each CPU and the share of the spin time they took
+ */
+static void print_noise(void)
+{
+	uint64_t spin = (uint64_t)tests_done * num_loops * 1000;
+
+	for (int i = 0; i < num_cpus; i++)
+		printf("CPU %d noise %lu gaps above %luns, %luns total "
+				"(%.6f%% of %luns), max gap %luns\n",
+				td[i].cpu, td[i].gaps, noise_threshold,
+				td[i].noise, td[i].noise * 100.0 / spin, spin,
+				td[i].stats.max);
+}
+
+static const char *mode_name(void)
+{
+	if (sweep)
+		return "sweep";
+	if (noise_threshold)
+		return "noise";
+	if (pipeline)
+		return "pipeline";
+	if (period_hz)
+		return "periodic";
+
+	return "loop";
+}
+
+static uint64_t stats_mean(const struct jitter_stats *st)
+{
+	return st->count ? st->sum / st->count : 0;
+}
+
+static void json_stats(const struct jitter_stats *st)
+{
+	fprintf(out_fd, "{\"max\": %lu, \"min\": %lu, \"mean\": %lu}",
+			st->max, st->min, stats_mean(st));
+}
+
+static void json_hist(const struct tif_hist *h)
+{
+	fprintf(out_fd, "{\"samples\": %lu, \"min\": %lu, \"max\": %lu, "
+			"\"p50\": %lu, \"p99\": %lu, \"p99.9\": %lu, "
+			"\"p99.99\": %lu}", h->count, h->min, h->max,
+			tif_hist_percentile(h, 50), tif_hist_percentile(h, 99),
+			tif_hist_percentile(h, 99.9),
+			tif_hist_percentile(h, 99.99));
+}
+
+static void json_meta_str(const char *name, const char *val, int last)
+{
+	fprintf(out_fd, "\t\t\"%s\": ", name);
+	tif_json_str(out_fd, val);
+	fprintf(out_fd, "%s\n", last ? "" : ",");
+}
+
+/*
+ * Writes run metadata, configuration and results of each CPU and of all
+ * CPUs as a JSON object. Times are in nanoseconds.
+ */
+static void write_json(void)
+{
+	struct thread_data *t;
+
+	fprintf(out_fd, "{\n\t\"metadata\": {\n");
+	json_meta_str("time", meta.time, 0);
+	json_meta_str("hostname", meta.hostname, 0);
+	json_meta_str("kernel", meta.kernel, 0);
+	json_meta_str("cmdline", meta.cmdline, 0);
+	json_meta_str("nohz_full", meta.nohz_full, 0);
+	json_meta_str("isolcpus", meta.isolcpus, 0);
+	json_meta_str("cpu_model", meta.cpu_model, 0);
+	fprintf(out_fd, "\t\t\"tsc_hz\": %lu,\n", tif_tsc.hz);
+	fprintf(out_fd, "\t\t\"tsc_invariant\": %s,\n",
+			tif_tsc.invariant ? "true" : "false");
+	json_meta_str("options", options, 1);
+
+	fprintf(out_fd, "\t},\n\t\"config\": {\n\t\t\"cpus\": [");
+	for (int i = 0; i < num_cpus; i++)
+		fprintf(out_fd, "%s%d", i ? ", " : "", nohz_cpus[i]);
+	fprintf(out_fd, "],\n\t\t\"mode\": \"%s\",\n", mode_name());
+	fprintf(out_fd, "\t\t\"workload\": ");
+	tif_json_str(out_fd, noise_threshold ? "noise" : workload->name);
+	fprintf(out_fd, ",\n\t\t\"workload_arg\": ");
+	tif_json_str(out_fd, workload_arg ? workload_arg : "");
+	fprintf(out_fd, ",\n\t\t\"clock\": \"%s\",\n",
+			use_tsc ? "tsc" : "monotonic");
+	fprintf(out_fd, "\t\t\"tests\": %d,\n", duration ? 0 : num_tests);
+	fprintf(out_fd, "\t\t\"loops\": %d,\n", num_loops);
+	fprintf(out_fd, "\t\t\"duration_min\": %d,\n", duration);
+	fprintf(out_fd, "\t\t\"persistent\": %s,\n",
+			persistent ? "true" : "false");
+	fprintf(out_fd, "\t\t\"period_hz\": %u,\n", period_hz);
+	fprintf(out_fd, "\t\t\"noise_threshold_ns\": %lu,\n",
+			noise_threshold);
+	fprintf(out_fd, "\t\t\"huge_pages\": %s\n",
+			huge_pages ? "true" : "false");
+
+	fprintf(out_fd, "\t},\n\t\"results\": {\n");
+	fprintf(out_fd, "\t\t\"tests\": %u,\n\t\t\"cpus\": [\n",
+			tests_done);
+	for (int i = 0; i < num_cpus; i++) {
+		t = &td[i];
+		fprintf(out_fd, "\t\t\t{\"cpu\": %d, \"jitter\": ", t->cpu);
+		json_stats(&t->stats);
+		if (t->hist) {
+			fprintf(out_fd, ", \"hist\": ");
+			json_hist(t->hist);
+		}
+		if (noise_threshold)
+			fprintf(out_fd, ", \"gaps\": %lu, \"noise\": %lu",
+					t->gaps, t->noise);
+		if (period_hz && !pipeline) {
+			fprintf(out_fd, ", \"compute\": ");
+			json_stats(&t->compute);
+			fprintf(out_fd, ", \"misses\": %lu", t->misses);
+		}
+		if (pmu && smi_avail)
+			fprintf(out_fd, ", \"smi\": %lu", t->smi_total);
+		if (pmu && smi_avail && !persistent)
+			fprintf(out_fd, ", \"smi_tests\": %lu", t->smi_tests);
+		if (attrib) {
+			fprintf(out_fd, ", \"worst_causes\": {");
+			for (int c = 0; c < ATTRIB_NUM; c++)
+				fprintf(out_fd, "%s\"%s\": %lu", c ? ", " : "",
+						tif_attrib_names[c],
+						t->worst_causes.v[c]);
+			fprintf(out_fd, "}");
+		}
+		fprintf(out_fd, "}%s\n", i < num_cpus - 1 ? "," : "");
+	}
+
+	merge_hist();
+	fprintf(out_fd, "\t\t],\n\t\t\"all\": {\"jitter\": ");
+	json_stats(&total_stats);
+	fprintf(out_fd, ", \"hist\": ");
+	json_hist(&total_hist);
+	fprintf(out_fd, "}");
+
+	if (pipeline) {
+		fprintf(out_fd, ",\n\t\t\"hops\": [\n");
+		for (int i = 1; i < num_cpus; i++) {
+			fprintf(out_fd, "\t\t\t{\"from\": %d, \"to\": %d, "
+					"\"placement\": \"%s\", \"hist\": ",
+					td[i - 1].cpu, td[i].cpu,
+					placement(td[i - 1].cpu, td[i].cpu));
+			if (td[i].hist)
+				json_hist(td[i].hist);
+			else
+				fprintf(out_fd, "null");
+			fprintf(out_fd, "}%s\n", i < num_cpus - 1 ? "," : "");
+		}
+		fprintf(out_fd, "\t\t]");
+	}
+
+	//Width is null while there are too few samples for an interval
+	if (ci_pct && ci.width >= 0)
+		fprintf(out_fd, ",\n\t\t\"confidence\": {\"percentile\": %g, "
+				"\"value\": %lu, \"low\": %lu, \"high\": %lu, "
+				"\"width_pct\": %.4f, \"target_pct\": %g, "
+				"\"reached\": %s}", ci_pct, ci.est, ci.low,
+				ci.high, ci.width, ci_target,
+				ci.reached ? "true" : "false");
+	else if (ci_pct)
+		fprintf(out_fd, ",\n\t\t\"confidence\": {\"percentile\": %g, "
+				"\"width_pct\": null, \"target_pct\": %g, "
+				"\"reached\": false}", ci_pct, ci_target);
+
+	fprintf(out_fd, "\n\t}\n}\n");
+}
+
+static void csv_row(const char *cpu, const struct jitter_stats *st,
+		const struct tif_hist *h)
+{
+	const char *meta_str[] = { meta.time, meta.hostname, meta.kernel,
+		meta.cpu_model, meta.nohz_full, meta.isolcpus, meta.cmdline,
+		options };
+
+	for (int i = 0; i < (int)(sizeof(meta_str) / sizeof(meta_str[0]));
+			i++) {
+		tif_csv_str(out_fd, meta_str[i]);
+		fputc(',', out_fd);
+	}
+
+	fprintf(out_fd, "%lu,%s,", tif_tsc.hz, mode_name());
+	tif_csv_str(out_fd, noise_threshold ? "noise" : workload->name);
+	fprintf(out_fd, ",%s,%u,%lu,%lu,%lu,%lu,%lu,%lu,%lu,%lu,%lu,%lu\n",
+			cpu, tests_done, st->max, st->min, stats_mean(st),
+			h->count, h->min, h->max, tif_hist_percentile(h, 50),
+			tif_hist_percentile(h, 99),
+			tif_hist_percentile(h, 99.9),
+			tif_hist_percentile(h, 99.99));
+}
+
+/*
+ * Writes a CSV header and a row of metadata and results for each CPU
+ * followed by a row for all CPUs. Times are in nanoseconds.
+ */
+static void write_csv(void)
+{
+	char cpu[16];
+
+	fprintf(out_fd, "time,hostname,kernel,cpu_model,nohz_full,isolcpus,"
+			"cmdline,options,tsc_hz,mode,workload,cpu,tests,"
+			"jitter_max,jitter_min,jitter_mean,samples,min,max,"
+			"p50,p99,p99.9,p99.99\n");
+
+	for (int i = 0; i < num_cpus && td[i].hist; i++) {
+		snprintf(cpu, sizeof(cpu), "%d", td[i].cpu);
+		csv_row(cpu, &td[i].stats, td[i].hist);
+	}
+
+	merge_hist();
+	csv_row("all", &total_stats, &total_hist);
 }
 
 static void cleanup(void)
 {
+	//Move cursor below the rows printed by print_jitter()
+	for (int i = 0; i < (tests_done && !sweep ? print_rows() : 0); i++)
+		printf("\n");
+
 	printf("\n\n");
 	nohz_exit();
-	if (hist_fd)
+	if (tune)
+		tif_preflight_revert();
+
+	//Validate TSC clock against the kernel clock after the run
+	if (use_tsc && tests_done)
+		printf("TSC clock drift from CLOCK_MONOTONIC: %ldns\n",
+				tif_tsc_drift());
+
+	if (captures) {
+		tif_capture_stop();
+		for (int i = 0; i < num_cpus; i++) {
+			if (captures[i].dropped)
+				printf("CPU %d dropped %lu raw samples\n",
+						captures[i].cpu,
+						captures[i].dropped);
+			tif_capture_free(&captures[i]);
+		}
+	}
+	if (attrib) {
+		for (int i = 0; i < num_cpus && tests_done; i++) {
+			printf("CPU %d worst jitter %luns causes: ", td[i].cpu,
+					td[i].worst);
+			tif_attrib_print(&td[i].worst_causes, stdout);
+			printf("\n");
+		}
+		tif_attrib_close();
+	}
+	if (pmu && tests_done)
+		print_counters();
+	if (smi_avail)
+		close_smi();
+	if (noise_threshold && tests_done)
+		print_noise();
+	if (period_hz && tests_done && !pipeline)
+		print_periodic();
+	if (pipeline && tests_done)
+		print_pipeline();
+	if (ci_pct && tests_done)
+		print_ci();
+
+	//A run without results is not reported as one
+	if (out_fd) {
+		if (!tests_done)
+			printf("No tests done, %s not written\n", out_file);
+		else if (out_format == OUT_JSON)
+			write_json();
+		else
+			write_csv();
+		fclose(out_fd);
+		out_fd = NULL;
+		if (!tests_done)
+			unlink(out_file);
+	}
+
+	if (hist_fd) {
+		if (!sweep)
+			write_hist();
+		if (attrib && tests_done)
+			write_causes();
+		if (pmu && tests_done)
+			write_counters();
 		fclose(hist_fd);
+	}
 }
 
+/*
+ * Returns 1 once duration minutes have passed since the first call
+ */
 static int time_expired(void)
 {
-	static int elapsed;
+	static struct timespec start;
 	struct timespec time;
 
-	clock_gettime(CLOCK_REALTIME, &time);
-	if (!elapsed) {
-		elapsed = time.tv_sec/60;
+	clock_gettime(CLOCK_MONOTONIC, &time);
+	if (!start.tv_sec && !start.tv_nsec) {
+		start = time;
 		return 0;
 	}
 
-	if (time.tv_sec/60 - elapsed > duration)
-		return 1;
-
-	return 0;
+	return time.tv_sec - start.tv_sec >= duration * 60L;
 }
 
 static void signal_handler(int signalno)
@@ -124,14 +878,17 @@ static void signal_handler(int signalno)
 	}
 }
 
-static void *rt_thread(void *arg)
+/*
+ * Sets up the calling thread for running the workload in nohz state
+ * on the thread's CPU and waits till RT threads on all other CPUs are
+ * also ready.
+ *
+ * Returns 0 on success, -1 on error
+ */
+static int rt_setup(struct thread_data *td_ptr)
 {
-	struct thread_data *td_ptr = (struct thread_data *) arg;
-	uint64_t max = 0, min = -1;
 	long ret;
 
-	td_ptr->ret = 0;
-
 	/*
 	 * Nohz is setup as follows
 	 * - Assign 100% scheduler runtime to RT tasks
@@ -141,15 +898,44 @@ static void *rt_thread(void *arg)
 	if (set_cpu_affinity(td_ptr->cpu, 0) < 0) {
 		printf("Thread [%d]:Error setting affinity to CPU %d\n",
 				getpid(), td_ptr->cpu);
-		td_ptr->ret = -1;
-		return NULL;
+		goto err;
+	}
+
+	//Workload memory is allocated once per CPU from the CPU itself
+	if (!noise_threshold && !td_ptr->wl_ready) {
+		if (workload->init(&td_ptr->wl_ctx, workload_arg)) {
+			printf("Thread [%d]:Error initializing workload %s\n",
+					getpid(), workload->name);
+			goto err;
+		}
+		td_ptr->wl_ready = 1;
+	}
+
+	//Counters of this thread, opened before nohz entry
+	if (pmu && pmu_counters) {
+		if (!tif_pmu_open(&td_ptr->pmu)) {
+			tif_pmu_close(&td_ptr->pmu);
+			printf("Thread [%d]:Error opening hardware counters\n",
+					getpid());
+			goto err;
+		}
+		td_ptr->pmu_open = 1;
+	}
+
+	//Memory is locked by main thread, fault in the stack used by the loop
+	if (prefault_stack)
+		tif_prefault_stack(prefault_stack);
+
+	//100% RT runtime setting started by main thread must be in effect
+	if (nohz_enter_wait()) {
+		printf("Thread [%d]:Error setting up NOHZ_FULL\n", getpid());
+		goto err;
 	}
 
 	if (set_sched_fifo(0) < 0) {
 		printf("Thread [%d]:Error setting FIFO scheduling policy\n",
 				getpid());
-		td_ptr->ret = -1;
-		return NULL;
+		goto err;
 	}
 
 	/* First try without 'forced' and shorter wait */
@@ -161,60 +947,532 @@ static void *rt_thread(void *arg)
 
 	if (ret < 0) {
 		printf("Thread [%d]:Error entering nohz state\n", getpid());
-		td_ptr->ret = -1;
-		return NULL;
+		goto err;
 	}
 
-	for (int l = 0; l < num_loops; l++) {
-		uint64_t start, end, diff;
+	/*
+	 * Wait for the RT threads on all other CPUs to enter nohz state so
+	 * that the workloads run simultaneously and cross core interference
+	 * gets measured. Spin instead of blocking to stay in nohz state.
+	 */
+	td_ptr->ktid = syscall(SYS_gettid);
+	__atomic_add_fetch(&threads_ready, 1, __ATOMIC_RELEASE);
+	while (__atomic_load_n(&threads_ready, __ATOMIC_ACQUIRE) < num_cpus)
+		_mm_pause();
 
-		start = get_time();
+	//Main thread reads the counters before the test starts
+	while (sync_tests && !__atomic_load_n(&attrib_go, __ATOMIC_ACQUIRE))
+		_mm_pause();
 
-		nohz_workload();
+	return 0;
 
-		end = get_time();
+err:
+	td_ptr->ret = -1;
+	//Do not hold up the RT threads waiting on other CPUs
+	__atomic_add_fetch(&threads_ready, 1, __ATOMIC_RELEASE);
 
-		diff = end - start;
+	return -1;
+}
 
-		if (diff > max)
-			max = diff;
+/*
+ * Adds the counters of a loop to its duration range
+ */
+static inline void pmu_record(struct thread_data *td_ptr, uint64_t diff,
+		const struct tif_pmu_count *before,
+		const struct tif_pmu_count *after)
+{
+	struct pmu_bucket *b;
+	uint64_t d;
 
-		if (diff < min)
-			min = diff;
-	}
+	b = &td_ptr->loop_counts[diff ? 64 - __builtin_clzll(diff) : 0];
+	b->loops++;
 
-	td_ptr->jitter = max - min;
+	for (int c = 0; c < PMU_EVENTS; c++) {
+		d = after->v[c] - before->v[c];
+		b->counts.v[c] += d;
+		if (diff >= td_ptr->slowest)
+			td_ptr->slowest_counts.v[c] = d;
+	}
 
-	return NULL;
+	if (diff >= td_ptr->slowest)
+		td_ptr->slowest = diff;
 }
 
-static void help(void)
+/*
+ * Runs num_loops workload iterations and returns the jitter. With
+ * hardware counters, they are read with rdpmc around every loop.
+ */
+static uint64_t rt_loops(struct thread_data *td_ptr)
 {
-	printf("\nUsage:\n\nnohz_jitter [options]\n\n");
-	printf("-a <cpu>         NOHZ CPU to run workload in\n");
-	printf("-t <num tests>   Number of tests to run\n");
-	printf("-l <num loops>   Number of loops per test\n");
-	printf("-d <minutes>     Max duration in minutes\n");
-	printf("-D <hours>       Max duration in hours\n");
-	printf("-c               Use TSC instead of default clock\n");
-	printf("-h               Generate histogram in nohz.hist file\n");
-	printf("-H <file name>   Generate histogram in file with given name\n");
+	struct tif_pmu_count before, after;
+	uint64_t max = 0, min = -1;
+
+	for (int l = 0; l < num_loops; l++) {
+		uint64_t start, end, diff;
+
+		if (pmu)
+			tif_pmu_read(&td_ptr->pmu, &before);
+
+		start = get_time_start();
+
+		workload->run(td_ptr->wl_ctx);
+
+		end = get_time_stop();
+
+		diff = get_elapsed(start, end);
+
+		if (pmu) {
+			tif_pmu_read(&td_ptr->pmu, &after);
+			pmu_record(td_ptr, diff, &before, &after);
+		}
+
+		tif_hist_record(td_ptr->hist, diff);
+
+		if (td_ptr->cap)
+			tif_capture_add(td_ptr->cap, start, end);
+
+		if (diff > max)
+			max = diff;
+
+		if (diff < min)
+			min = diff;
+	}
+
+	return max - min;
+}
+
+/*
+ * Spins reading the TSC for noise_window ticks. Every gap between two
+ * reads above noise_ticks is interference from outside the thread. Gaps
+ * are recorded in the histogram and, with capture, as start/end samples.
+ * Returns the largest gap in ns.
+ */
+static uint64_t rt_noise(struct thread_data *td_ptr)
+{
+	uint64_t prev, now, end, gap, max = 0;
+
+	prev = __rdtsc();
+	end = prev + noise_window;
+
+	while (prev < end) {
+		now = __rdtsc();
+
+		if (now - prev > noise_ticks) {
+			gap = tif_tsc_to_ns(now - prev);
+
+			tif_hist_record(td_ptr->hist, gap);
+			if (td_ptr->cap)
+				tif_capture_add(td_ptr->cap, prev, now);
+
+			td_ptr->gaps++;
+			td_ptr->noise += gap;
+			if (gap > max)
+				max = gap;
+
+			//Do not count the recording as a gap
+			now = __rdtsc();
+		}
+
+		prev = now;
+	}
+
+	return max;
+}
+
+/*
+ * Runs num_loops cycles of the workload, each woken at an absolute TSC
+ * deadline period_ticks after the previous one. The thread busy waits
+ * for the deadline instead of sleeping, so no timer is armed in the nohz
+ * CPU. Wake up lateness of every cycle is recorded in the histogram and
+ * the largest is returned. A cycle running past the next deadline misses
+ * it and the deadlines overrun are skipped.
+ */
+static uint64_t rt_periodic(struct thread_data *td_ptr)
+{
+	struct tif_pmu_count before, after;
+	uint64_t deadline, wake, done, late, compute, missed, max = 0;
+
+	deadline = __rdtsc() + period_ticks;
+
+	for (int l = 0; l < num_loops; l++) {
+		while ((wake = __rdtsc()) < deadline)
+			_mm_pause();
+
+		if (pmu)
+			tif_pmu_read(&td_ptr->pmu, &before);
+
+		workload->run(td_ptr->wl_ctx);
+
+		done = tif_tsc_stop();
+
+		late = tif_tsc_to_ns(wake - deadline);
+		compute = tif_tsc_to_ns(tif_tsc_elapsed(wake, done));
+
+		if (pmu) {
+			tif_pmu_read(&td_ptr->pmu, &after);
+			pmu_record(td_ptr, compute, &before, &after);
+		}
+
+		tif_hist_record(td_ptr->hist, late);
+		update_stats(&td_ptr->compute, compute);
+
+		if (td_ptr->cap)
+			tif_capture_add(td_ptr->cap, wake, done);
+
+		if (late > max)
+			max = late;
+
+		deadline += period_ticks;
+		if (done > deadline) {
+			missed = (done - deadline) / period_ticks + 1;
+			td_ptr->misses += missed;
+			deadline += missed * period_ticks;
+		}
+	}
+
+	return max;
+}
+
+/*
+ * Runs num_loops tokens through the calling pipeline stage. The first
+ * stage starts a token when the last stage has finished the previous one,
+ * or at absolute deadlines in periodic mode, and every stage runs the
+ * workload on it before pushing it to the next. Each stage records the
+ * latency of the hop from the previous stage in its histogram and the
+ * last stage records end to end latency in the first stage's histogram.
+ * Returns jitter of the hop, or end to end jitter for the first stage.
+ */
+static uint64_t rt_pipe(struct thread_data *td_ptr)
+{
+	int stage = td_ptr - td, last = num_cpus - 1;
+	uint64_t now, lat, deadline = 0, max = 0, min = -1;
+	uint64_t e2e_max = 0, e2e_min = -1;
+	struct pipe_token tok;
+
+	//A stage that failed setup would leave the others waiting
+	for (int i = 0; i < num_cpus; i++)
+		if (__atomic_load_n(&td[i].ret, __ATOMIC_RELAXED) == -1)
+			return 0;
+
+	if (period_hz)
+		deadline = __rdtsc() + period_ticks;
+
+	for (int l = 0; l < num_loops; l++) {
+		if (!stage) {
+			if (period_hz) {
+				while (__rdtsc() < deadline)
+					_mm_pause();
+				deadline += period_ticks;
+			} else {
+				//One token in flight measures pure handoff
+				while (__atomic_load_n(&pipe_done,
+							__ATOMIC_ACQUIRE) != l)
+					_mm_pause();
+			}
+			tok.seq = l;
+			tok.start = tif_tsc_start();
+		} else {
+			while (tif_ring_pop(&pipe_rings[stage - 1], &tok))
+				_mm_pause();
+			now = tif_tsc_stop();
+
+			lat = tif_tsc_to_ns(tif_tsc_elapsed(tok.sent, now));
+			tif_hist_record(td_ptr->hist, lat);
+			if (lat > max)
+				max = lat;
+			if (lat < min)
+				min = lat;
+		}
+
+		workload->run(td_ptr->wl_ctx);
+
+		if (stage < last) {
+			tok.sent = tif_tsc_start();
+			while (tif_ring_push(&pipe_rings[stage], &tok))
+				_mm_pause();
+			continue;
+		}
+
+		now = tif_tsc_stop();
+		lat = tif_tsc_to_ns(tif_tsc_elapsed(tok.start, now));
+		tif_hist_record(td[0].hist, lat);
+		if (lat > e2e_max)
+			e2e_max = lat;
+		if (lat < e2e_min)
+			e2e_min = lat;
+
+		if (l == num_loops - 1)
+			pipe_jitter = e2e_max - e2e_min;
+		__atomic_store_n(&pipe_done, l + 1, __ATOMIC_RELEASE);
+	}
+
+	if (stage)
+		return max - min;
+
+	//End to end jitter is known once the last stage is done
+	while (__atomic_load_n(&pipe_done, __ATOMIC_ACQUIRE) != num_loops)
+		_mm_pause();
+
+	return pipe_jitter;
+}
+
+/*
+ * Runs one test and returns the jitter, the largest gap in noise mode,
+ * the largest wake up lateness in periodic mode or pipeline jitter.
+ * Must not make system calls.
+ */
+static uint64_t rt_measure(struct thread_data *td_ptr)
+{
+	if (noise_threshold)
+		return rt_noise(td_ptr);
+	if (pipeline)
+		return rt_pipe(td_ptr);
+	if (period_hz)
+		return rt_periodic(td_ptr);
+
+	return rt_loops(td_ptr);
+}
+
+static void pmu_close(struct thread_data *td_ptr)
+{
+	if (td_ptr->pmu_open)
+		tif_pmu_close(&td_ptr->pmu);
+	td_ptr->pmu_open = 0;
+}
+
+/*
+ * RT thread running a single test
+ */
+static void *rt_thread(void *arg)
+{
+	struct thread_data *td_ptr = (struct thread_data *) arg;
+
+	td_ptr->ret = 0;
+
+	if (rt_setup(td_ptr))
+		goto ext;
+
+	td_ptr->jitter = rt_measure(td_ptr);
+
+	//Stay alive till the main thread reads the counters
+	if (sync_tests) {
+		__atomic_store_n(&td_ptr->measured, 1, __ATOMIC_RELEASE);
+		while (!__atomic_load_n(&td_ptr->release, __ATOMIC_ACQUIRE))
+			_mm_pause();
+	}
+
+ext:
+	pmu_close(td_ptr);
+
+	return NULL;
+}
+
+/*
+ * Persistent RT thread. Enters nohz state once and runs tests back to
+ * back, passing the results to the main thread through the thread's
+ * ring. Runs num_tests tests or, if a duration is set, till the main
+ * thread asks it to stop. The main thread also stops it once the
+ * confidence interval is narrow enough.
+ */
+static void *rt_worker(void *arg)
+{
+	struct thread_data *td_ptr = (struct thread_data *) arg;
+	struct test_result res;
+
+	td_ptr->ret = 0;
+
+	if (rt_setup(td_ptr))
+		goto ext;
+
+	for (int t = 0; duration || t < num_tests; t++) {
+		if (__atomic_load_n(&stop_workers, __ATOMIC_RELAXED))
+			break;
+
+		res.jitter = rt_measure(td_ptr);
+
+		//Spin if the main thread has not caught up yet
+		while (tif_ring_push(&td_ptr->ring, &res)) {
+			if (__atomic_load_n(&stop_workers, __ATOMIC_RELAXED))
+				goto ext;
+			_mm_pause();
+		}
+	}
+
+ext:
+	pmu_close(td_ptr);
+	__atomic_store_n(&td_ptr->done, 1, __ATOMIC_RELEASE);
+
+	return NULL;
+}
+
+static void help(void)
+{
+	printf("\nUsage:\n\nnohz_jitter [options]\n\n");
+	printf("-a <cpu list>    NOHZ CPUs to run workload in e.g. 1,3-5\n");
+	printf("-A               Run workload in all NOHZ CPUs\n");
+	printf("-t <num tests>   Number of tests to run\n");
+	printf("-l <num loops>   Number of loops per test\n");
+	printf("-d <minutes>     Max duration in minutes\n");
+	printf("-D <hours>       Max duration in hours\n");
+	printf("-c               Use TSC instead of default clock\n");
+	printf("-p               Persistent RT threads running all tests\n");
+	printf("-h               Generate histogram in nohz.hist file\n");
+	printf("-H <file name>   Generate histogram in file with given name\n");
+	printf("-r <file name>   Capture raw start/end of every loop to file\n");
+	printf("-s               Sweep chase workload working set from L1\n");
+	printf("                 to past LLC size, -t tests per size\n");
+	printf("-w <name[:arg]>  Workload to run, default %s\n",
+			DEFAULT_WORKLOAD);
+	tif_workload_list(stdout);
+	printf("-R               Restore system settings left changed by a\n");
+	printf("                 killed run and exit\n");
+	printf("-P               Audit isolation environment of the CPUs and\n");
+	printf("                 exit, exit status 1 if violations are found.\n");
+	printf("                 With -T fixes and leaves them till -R,\n");
+	printf("                 except C-states\n");
+	printf("-T               Fix isolation environment violations before\n");
+	printf("                 running and revert at exit\n");
+	printf("-F <dir>         Root directory of /proc, /sys and /dev used\n");
+	printf("                 by -P and -T\n");
+	printf("-m <KB>          Lock memory and pre-fault given KB of RT\n");
+	printf("                 thread stacks before nohz entry\n");
+	printf("-M               Back workload buffers with huge pages\n");
+	printf("-i               Attribute jitter to interrupts, softirqs and\n");
+	printf("                 context switches of each test\n");
+	printf("-e               Read hardware counters around every loop\n");
+	printf("                 and SMI count around tests\n");
+	printf("-q <pct[:width]> Run till the 95%% confidence interval of the\n");
+	printf("                 given percentile of the histogram (loop\n");
+	printf("                 duration, lateness, gap or latency of the\n");
+	printf("                 mode) is narrower than width %% of it\n");
+	printf("                 (default %g), or -d/-D, or -t tests\n",
+			CI_WIDTH);
+	printf("                 (default %d without -d/-D)\n", CI_MAX_TESTS);
+	printf("-f <hz>          Periodic mode, run each loop at absolute\n");
+	printf("                 deadlines of given rate, busy waiting\n");
+	printf("-x <cpu list>    Pipeline mode, chain RT threads on NOHZ CPUs\n");
+	printf("                 in given order e.g. 3,1,5 through rings and\n");
+	printf("                 measure each hop and end to end latency\n");
+	printf("-n <ns>          Noise mode, spin reading TSC for -l us per\n");
+	printf("                 test and record gaps above given ns\n");
+	printf("-o <json|csv>    Write results and run metadata in given\n");
+	printf("                 format to %s.json or %s.csv\n", OUT_FILE,
+			OUT_FILE);
+	printf("-O <file name>   Write -o results to file with given name\n");
 	printf("\n");
 }
 
+/*
+ * Sets the CPUs to run the workload in from the passed mask and frees it.
+ * If validate is set, each CPU is checked to be a valid NOHZ CPU.
+ *
+ * Returns 0 on success, -1 on error
+ */
+static int set_nohz_cpus(struct bitmask *mask, int validate)
+{
+	int ret = -1;
+
+	if (!mask) {
+		printf("Invalid NOHZ CPU list\n");
+		return -1;
+	}
+
+	num_cpus = 0;
+	for (unsigned int c = 0; c < mask->size; c++) {
+		if (!numa_bitmask_isbitset(mask, c))
+			continue;
+
+		if (validate && !is_nohz_cpu(c)) {
+			printf("Invalid NOHZ CPU %u\n", c);
+			goto ext;
+		}
+
+		if (!c)
+			continue;
+
+		if (num_cpus == MAX_CPUS) {
+			printf("Too many NOHZ CPUs, max %d\n", MAX_CPUS);
+			goto ext;
+		}
+
+		nohz_cpus[num_cpus++] = c;
+	}
+
+	if (num_cpus)
+		ret = 0;
+	else
+		printf("No NOHZ CPU in list\n");
+
+ext:
+	numa_bitmask_free(mask);
+
+	return ret;
+}
+
+/*
+ * Sets the CPUs of the pipeline stages from an ordered CPU list e.g.
+ * 3,1,5-7. Each CPU must be a NOHZ CPU and appear once.
+ *
+ * Returns 0 on success, -1 on error
+ */
+static int set_pipe_cpus(char *list)
+{
+	char *tok, *save, *end;
+	long first, last;
+
+	num_cpus = 0;
+	for (tok = strtok_r(list, ",", &save); tok;
+			tok = strtok_r(NULL, ",", &save)) {
+		first = last = strtol(tok, &end, 10);
+		if (end != tok && *end == '-')
+			last = strtol(end + 1, &end, 10);
+		if (end == tok || *end || first < 0 || last < first) {
+			printf("Invalid pipeline CPU list\n");
+			return -1;
+		}
+
+		for (long c = first; c <= last; c++) {
+			if (!is_nohz_cpu(c)) {
+				printf("Invalid NOHZ CPU %ld\n", c);
+				return -1;
+			}
+			for (int i = 0; i < num_cpus; i++) {
+				if (nohz_cpus[i] == c) {
+					printf("CPU %ld repeated in pipeline\n", c);
+					return -1;
+				}
+			}
+			if (num_cpus == MAX_CPUS) {
+				printf("Too many NOHZ CPUs, max %d\n", MAX_CPUS);
+				return -1;
+			}
+			nohz_cpus[num_cpus++] = c;
+		}
+	}
+
+	if (num_cpus < 2) {
+		printf("Pipeline needs at least 2 NOHZ CPUs\n");
+		return -1;
+	}
+
+	return 0;
+}
+
 int parse_args(int argc, char **argv)
 {
+	struct bitmask *mask;
+	char *end;
 	int o;
 
 	for (;;) {
 		opterr = 0;
-		o = getopt(argc, argv, "a:t:l:d:D:chH:");
+		o = getopt(argc, argv, "a:At:l:d:D:cpshH:r:w:RPTF:m:Mien:q:f:x:o:O:");
 		if (o == -1)
 			break;
 
 		if (o == '?' || optopt ||
 				(optarg && optarg[0] == '-') ||
-				(strchr("atldDH", o) && !optarg)) {
+				(strchr("atldDHrwFmnqfxoO", o) && !optarg)) {
 			help();
 
 			return -1;
@@ -222,11 +1480,16 @@ int parse_args(int argc, char **argv)
 
 		switch (o) {
 		case 'a':
-			nohz_cpu = atoi(optarg);
-			if (!is_nohz_cpu(nohz_cpu)) {
-				printf("Invalid NOHZ CPU\n");
+			cpu_list = optarg;
+			break;
+		case 'A':
+			mask = get_nohz_full_cpu_mask();
+			if (!mask) {
+				printf("NOHZ cpu not found\n");
 				return -1;
 			}
+			if (set_nohz_cpus(mask, 0))
+				return -1;
 			break;
 		case 't':
 			num_tests = atoi(optarg);
@@ -234,6 +1497,7 @@ int parse_args(int argc, char **argv)
 				printf("Invalid num tests\n");
 				return -1;
 			}
+			tests_set = 1;
 			break;
 		case 'l':
 			num_loops = atoi(optarg);
@@ -255,6 +1519,12 @@ int parse_args(int argc, char **argv)
 		case 'c':
 			use_tsc = 1;
 			break;
+		case 'p':
+			persistent = 1;
+			break;
+		case 's':
+			sweep = 1;
+			break;
 		case 'h':
 		case 'H':
 			hist = 1;
@@ -266,9 +1536,167 @@ int parse_args(int argc, char **argv)
 				}
 			}
 			break;
+		case 'r':
+			capture_file = optarg;
+			break;
+		case 'w':
+			workload_arg = strchr(optarg, ':');
+			if (workload_arg)
+				*workload_arg++ = 0;
+			workload = tif_workload_find(optarg);
+			if (!workload) {
+				printf("Invalid workload %s\n", optarg);
+				return -1;
+			}
+			break;
+		case 'R':
+			restore_state = 1;
+			break;
+		case 'P':
+			audit = 1;
+			break;
+		case 'T':
+			tune = 1;
+			break;
+		case 'F':
+			if (tif_preflight_set_root(optarg)) {
+				printf("Invalid root directory\n");
+				return -1;
+			}
+			break;
+		case 'm':
+			prefault_stack = strtoul(optarg, NULL, 0) << 10;
+			if (!prefault_stack) {
+				printf("Invalid stack size\n");
+				return -1;
+			}
+			break;
+		case 'i':
+			attrib = 1;
+			break;
+		case 'e':
+			pmu = 1;
+			break;
+		case 'o':
+			if (!strcmp(optarg, "json")) {
+				out_format = OUT_JSON;
+			} else if (!strcmp(optarg, "csv")) {
+				out_format = OUT_CSV;
+			} else {
+				printf("Invalid output format %s\n", optarg);
+				return -1;
+			}
+			break;
+		case 'O':
+			out_file = optarg;
+			break;
+		case 'x':
+			pipe_list = optarg;
+			pipeline = 1;
+			//Stages hand over TSC timestamps
+			use_tsc = 1;
+			break;
+		case 'f':
+			period_hz = atoi(optarg);
+			if (!period_hz) {
+				printf("Invalid cycle rate\n");
+				return -1;
+			}
+			//Deadlines are TSC ticks
+			use_tsc = 1;
+			break;
+		case 'q':
+			ci_pct = strtod(optarg, &end);
+			if (*end == ':')
+				ci_target = strtod(end + 1, &end);
+			if (*end || ci_pct <= 0 || ci_pct >= 100 ||
+					ci_target <= 0) {
+				printf("Invalid percentile or CI width\n");
+				return -1;
+			}
+			break;
+		case 'n':
+			noise_threshold = strtoull(optarg, NULL, 0);
+			if (!noise_threshold) {
+				printf("Invalid noise threshold\n");
+				return -1;
+			}
+			//Gaps are measured in TSC ticks
+			use_tsc = 1;
+			break;
+		case 'M':
+			huge_pages = 1;
+			tif_workload_huge_pages(1);
+			break;
+		}
+	}
+
+	//Only -F applies to -R
+	if (restore_state)
+		return 0;
+
+	//Tests are capped in case the interval never gets narrow enough
+	if (ci_pct && !tests_set)
+		num_tests = CI_MAX_TESTS;
+
+	if (noise_threshold && period_hz) {
+		printf("Noise mode cannot be used with periodic mode\n");
+		return -1;
+	}
+
+	if (pipeline) {
+		if (cpu_list || num_cpus) {
+			printf("Pipeline CPUs are set with -x only\n");
+			return -1;
+		}
+		if (persistent || sweep || noise_threshold) {
+			printf("Pipeline cannot be used with -p, -s or -n\n");
+			return -1;
+		}
+		//Stages do not record loop counters or raw samples
+		if (pmu || capture_file) {
+			printf("Pipeline cannot be used with -e or -r\n");
+			return -1;
+		}
+		if (set_pipe_cpus(pipe_list))
+			return -1;
+	}
+
+	//CPUs audited need not be nohz_full CPUs
+	if (cpu_list && set_nohz_cpus(numa_parse_cpustring_all(cpu_list),
+				!audit))
+		return -1;
+
+	if (audit)
+		return 0;
+
+	if (sweep) {
+		if (duration) {
+			printf("Duration cannot be used with sweep\n");
+			return -1;
+		}
+		if (noise_threshold) {
+			printf("Noise mode cannot be used with sweep\n");
+			return -1;
+		}
+		if (ci_pct) {
+			printf("Adaptive stopping cannot be used with sweep\n");
+			return -1;
+		}
+		if (period_hz) {
+			printf("Periodic mode cannot be used with sweep\n");
+			return -1;
+		}
+		if (out_format) {
+			printf("Structured output cannot be used with sweep\n");
+			return -1;
 		}
+		workload = tif_workload_find("chase");
 	}
 
+	if (!workload)
+		workload = tif_workload_find(DEFAULT_WORKLOAD);
+
 	if (hist && !hist_fd) {
 		hist_fd = fopen(HIST_FILE, "w");
 		if (!hist_fd) {
@@ -277,13 +1705,19 @@ int parse_args(int argc, char **argv)
 		}
 	}
 
-	if (!nohz_cpu) {
+	if (out_file && !out_format) {
+		printf("Output file needs an output format\n");
+		return -1;
+	}
+
+	if (!num_cpus) {
 		//Get the first nohz_full CPU
-		nohz_cpu = get_nohz_full_cpu();
-		if (nohz_cpu == -1) {
+		nohz_cpus[0] = get_nohz_full_cpu();
+		if (nohz_cpus[0] == -1) {
 			printf("No nohz_full CPU found\n");
 			return -1;
 		}
+		num_cpus = 1;
 	}
 
 	return 0;
@@ -291,7 +1725,10 @@ int parse_args(int argc, char **argv)
 
 static void dump_opts(void)
 {
-	printf("NOHZ CPU : %d\n", nohz_cpu);
+	printf("NOHZ CPU :");
+	for (int i = 0; i < num_cpus; i++)
+		printf(" %d", nohz_cpus[i]);
+	printf("\n");
 	if (duration) {
 		printf("Max duration : %dm\n", duration);
 		printf("Num tests : N/A\n");
@@ -300,18 +1737,587 @@ static void dump_opts(void)
 		printf("Num tests : %d\n", num_tests);
 	}
 	printf("Num loops : %d\n", num_loops);
-	printf("Time unit : %s\n", use_tsc ? "TSC ticks" : "Nanoseconds");
+	if (ci_pct)
+		printf("Stop at : p%g 95%% CI width %g%%\n", ci_pct, ci_target);
+	if (pipeline) {
+		printf("Pipeline :");
+		for (int i = 0; i < num_cpus; i++)
+			printf("%s%d", i ? " -> " : " ", nohz_cpus[i]);
+		printf("\n");
+		for (int i = 1; i < num_cpus; i++)
+			printf("Hop %d->%d : %s\n", nohz_cpus[i - 1],
+					nohz_cpus[i],
+					placement(nohz_cpus[i - 1], nohz_cpus[i]));
+	}
+	if (sweep)
+		printf("Workload : chase sweep\n");
+	else if (noise_threshold)
+		printf("Workload : noise, gaps above %luns in %dus\n",
+				noise_threshold, num_loops);
+	else if (period_hz)
+		printf("Workload : %s%s%s every %luns (%uHz)\n",
+				workload->name, workload_arg ? ":" : "",
+				workload_arg ? workload_arg : "",
+				1000000000UL / period_hz, period_hz);
+	else
+		printf("Workload : %s%s%s\n", workload->name,
+				workload_arg ? ":" : "",
+				workload_arg ? workload_arg : "");
+	if (use_tsc)
+		printf("Clock : TSC %lu MHz%s from %s, overhead %lu ticks\n",
+				tif_tsc.hz / 1000000,
+				tif_tsc.invariant ? "" : " (not invariant)",
+				tif_tsc.source == TSC_SRC_KERNEL ?
+				"kernel" : "calibration",
+				tif_tsc.overhead);
+	else
+		printf("Clock : CLOCK_MONOTONIC, overhead %luns\n",
+				tif_tsc.clock_overhead);
+	printf("RT threads : %s\n", persistent ? "Persistent" : "Per test");
 	printf("Histogram : %s\n", hist_fd ? "Yes" : "No");
+	printf("Raw capture : %s\n", capture_file ? capture_file : "No");
+	printf("Fix isolation environment : %s\n", tune ? "Yes" : "No");
+	if (prefault_stack)
+		printf("Memory locked, stack pre-fault : %zuKB\n",
+				prefault_stack >> 10);
+	else
+		printf("Memory locked : No\n");
+	printf("Huge pages : %s\n", huge_pages ? "Yes" : "No");
+	printf("Jitter attribution : %s\n", attrib ? "Yes" : "No");
+	printf("Structured output : %s\n", out_format == OUT_JSON ? "JSON" :
+			out_format == OUT_CSV ? "CSV" : "No");
+	printf("Hardware counters :");
+	for (int i = 0; i < PMU_EVENTS; i++)
+		if (pmu_avail[i])
+			printf(" %s", tif_pmu_names[i]);
+	printf("%s%s\n", smi_avail ? " SMI" : "", pmu ? "" : " No");
+}
+
+/*
+ * Reads the counters of all CPUs and their RT threads
+ */
+static void attrib_snap(struct tif_attrib *snap)
+{
+	int tids[MAX_CPUS];
+
+	for (int i = 0; i < num_cpus; i++)
+		tids[i] = td[i].ktid;
+
+	tif_attrib_snap(nohz_cpus, tids, num_cpus, snap);
+}
+
+/*
+ * Adds the counts since the previous snapshot to the jitter range of the
+ * test on each CPU
+ */
+static void attrib_record(void)
+{
+	struct attrib_bucket *b;
+	struct tif_attrib d;
+
+	for (int i = 0; i < num_cpus; i++) {
+		tif_attrib_delta(&d, &attrib_prev[i], &attrib_cur[i]);
+
+		b = &td[i].causes[td[i].jitter ?
+			64 - __builtin_clzll(td[i].jitter) : 0];
+		b->tests++;
+		for (int c = 0; c < ATTRIB_NUM; c++)
+			b->causes.v[c] += d.v[c];
+
+		if (td[i].jitter >= td[i].worst) {
+			td[i].worst = td[i].jitter;
+			td[i].worst_causes = d;
+		}
+	}
+
+	memcpy(attrib_prev, attrib_cur, sizeof(attrib_prev));
+}
+
+/*
+ * Sets the 95% confidence interval of percentile ci_pct of the loop
+ * durations of all CPUs. The bounds are the samples at the ranks CI_Z
+ * standard deviations of the binomial count away from the percentile's
+ * rank, which holds for any distribution including the long tail of
+ * jitter. Bounds are accurate to the histogram bucket width.
+ */
+static void update_ci(void)
+{
+	double n, p = ci_pct / 100, rank, sd;
+
+	merge_hist();
+	n = total_hist.count;
+	rank = n * p;
+	sd = sqrt(n * p * (1 - p));
+
+	ci.width = -1;
+	if (rank - CI_Z * sd < 1 || ceil(rank + CI_Z * sd) > n)
+		return;
+
+	ci.est = tif_hist_percentile(&total_hist, ci_pct);
+	ci.low = tif_hist_value_at_rank(&total_hist, rank - CI_Z * sd);
+	ci.high = tif_hist_value_at_rank(&total_hist,
+			ceil(rank + CI_Z * sd));
+	ci.width = ci.est ? (ci.high - ci.low) * 100.0 / ci.est : 0;
+	ci.reached = ci.width <= ci_target;
+}
+
+/*
+ * Updates statistics and display with the results of a test
+ * that are in td[].jitter
+ */
+static void process_test(void)
+{
+	uint64_t worst = 0;
+
+	tests_done++;
+
+	if (attrib)
+		attrib_record();
+
+	for (int i = 0; i < num_cpus; i++) {
+		if (pmu && td[i].smi) {
+			td[i].smi_total += td[i].smi;
+			td[i].smi_tests++;
+			if (td[i].jitter > td[i].smi_worst)
+				td[i].smi_worst = td[i].jitter;
+		} else if (td[i].jitter > td[i].clean_worst) {
+			td[i].clean_worst = td[i].jitter;
+		}
+
+		update_stats(&td[i].stats, td[i].jitter);
+		update_stats(&total_stats, td[i].jitter);
+		if (td[i].jitter > worst)
+			worst = td[i].jitter;
+	}
+
+	if (ci_pct)
+		update_ci();
+
+	if (!sweep)
+		print_jitter(worst);
+}
+
+/*
+ * Returns 1 when the run should stop: once the confidence interval is
+ * narrow enough with adaptive stopping, else after the duration if one
+ * is set or after num_tests tests
+ */
+static int time_done(void)
+{
+	if (ci.reached)
+		return 1;
+
+	if (duration)
+		return time_expired();
+
+	return tests_done >= num_tests;
+}
+
+/*
+ * Reads the SMI count of every CPU. Makes system calls, so must be called
+ * from the main thread. At the end of a test, sets the SMIs since the
+ * last read in td[].smi.
+ */
+static void smi_snap(int end)
+{
+	uint64_t v;
+
+	if (!smi_avail)
+		return;
+
+	for (int i = 0; i < num_cpus; i++) {
+		td[i].smi = 0;
+		if (tif_smi_read(&td[i].smi_count, &v))
+			continue;
+
+		if (end && v > td[i].smi_last)
+			td[i].smi = v - td[i].smi_last;
+		td[i].smi_last = v;
+	}
+}
+
+/*
+ * Reads the counters right before and after a test of the RT threads
+ * created for it. The threads wait in nohz state for the main thread to
+ * start the test and, when done, to read their context switches, so that
+ * thread setup and the IPIs of SMI reads fall outside of the test.
+ */
+static void sync_test(void)
+{
+	int i;
+
+	while (__atomic_load_n(&threads_ready, __ATOMIC_ACQUIRE) < num_cpus)
+		usleep(ATTRIB_POLL_US);
+
+	if (attrib)
+		attrib_snap(attrib_prev);
+	smi_snap(0);
+	__atomic_store_n(&attrib_go, 1, __ATOMIC_RELEASE);
+
+	for (i = 0; i < num_cpus; i++)
+		while (td[i].ret != -1 &&
+				!__atomic_load_n(&td[i].measured, __ATOMIC_ACQUIRE))
+			usleep(ATTRIB_POLL_US);
+
+	smi_snap(1);
+	if (attrib)
+		attrib_snap(attrib_cur);
+
+	for (i = 0; i < num_cpus; i++)
+		__atomic_store_n(&td[i].release, 1, __ATOMIC_RELEASE);
+}
+
+/*
+ * Creates one RT thread per NOHZ CPU for every test
+ *
+ * Returns 0 on success, -1 on error
+ */
+static int run_per_test(void)
+{
+	int i;
+
+	sync_tests = attrib || smi_avail;
+	while (!time_done()) {
+		//One RT thread per NOHZ CPU, all running the test together
+		threads_ready = 0;
+		attrib_go = 0;
+		pipe_done = 0;
+		for (i = 0; i < num_cpus; i++) {
+			td[i].cpu = nohz_cpus[i];
+			td[i].measured = 0;
+			td[i].release = 0;
+
+			if (pthread_create(&td[i].tid, NULL, &rt_thread, &td[i])) {
+				printf("Error creating RT workload thread\n");
+				exit(EXIT_FAILURE);
+			}
+		}
+
+		if (sync_tests)
+			sync_test();
+
+		for (i = 0; i < num_cpus; i++)
+			pthread_join(td[i].tid, NULL);
+
+		for (i = 0; i < num_cpus; i++)
+			if (td[i].ret == -1)
+				return -1;
+
+		process_test();
+	}
+
+	return 0;
+}
+
+/*
+ * Creates one persistent RT thread per NOHZ CPU and collects the results
+ * of every test from their rings. A test is processed once results from
+ * all CPUs are available.
+ *
+ * Returns 0 on success, -1 on error
+ */
+static int run_persistent(void)
+{
+	struct test_result res;
+	int have[MAX_CPUS] = {0};
+	int i, n, fin, finished, ret = 0;
+
+	/*
+	 * Every SMI count read sends an IPI to the CPU, so with tests back to
+	 * back it is only read before the threads start and after they exit
+	 */
+	smi_snap(0);
+
+	threads_ready = 0;
+	stop_workers = 0;
+	for (i = 0; i < num_cpus; i++) {
+		td[i].cpu = nohz_cpus[i];
+		td[i].done = 0;
+
+		if (tif_ring_init(&td[i].ring, sizeof(struct test_result),
+					RING_SIZE)) {
+			printf("Error allocating result ring\n");
+			exit(EXIT_FAILURE);
+		}
+
+		if (pthread_create(&td[i].tid, NULL, &rt_worker, &td[i])) {
+			printf("Error creating RT workload thread\n");
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	/*
+	 * Tests run back to back, so counters are read when the results of
+	 * a test arrive, up to POLL_US after the test ends
+	 */
+	if (attrib) {
+		while (__atomic_load_n(&threads_ready, __ATOMIC_ACQUIRE) <
+				num_cpus)
+			usleep(ATTRIB_POLL_US);
+		attrib_snap(attrib_prev);
+	}
+
+	for (;;) {
+		if (ci.reached || (duration && time_expired()))
+			break;
+
+		n = 0;
+		finished = 0;
+		for (i = 0; i < num_cpus; i++) {
+			//Read done before pop to not miss the last result
+			fin = __atomic_load_n(&td[i].done, __ATOMIC_ACQUIRE);
+			if (fin && td[i].ret == -1) {
+				ret = -1;
+				goto ext;
+			}
+
+			if (!have[i] && !tif_ring_pop(&td[i].ring, &res)) {
+				td[i].jitter = res.jitter;
+				have[i] = 1;
+			} else if (!have[i] && fin) {
+				//No more results will come from this thread
+				finished = 1;
+			}
+			n += have[i];
+		}
+
+		if (n == num_cpus) {
+			if (attrib)
+				attrib_snap(attrib_cur);
+			process_test();
+			memset(have, 0, sizeof(have));
+			continue;
+		}
+
+		if (finished)
+			break;
+
+		usleep(POLL_US);
+	}
+
+ext:
+	__atomic_store_n(&stop_workers, 1, __ATOMIC_RELAXED);
+	for (i = 0; i < num_cpus; i++) {
+		pthread_join(td[i].tid, NULL);
+		tif_ring_free(&td[i].ring);
+	}
+
+	//SMIs of the whole run, not attributed to tests
+	smi_snap(1);
+	for (i = 0; i < num_cpus; i++)
+		td[i].smi_total += td[i].smi;
+
+	return ret;
+}
+
+/*
+ * Allocates locked capture buffers for all CPUs and starts streaming
+ * them to the capture file
+ *
+ * Returns 0 on success, -1 on error
+ */
+static int setup_capture(void)
+{
+	if (tif_capture_open(capture_file, use_tsc)) {
+		printf("Failed creating capture file\n");
+		return -1;
+	}
+
+	captures = calloc(num_cpus, sizeof(struct tif_capture));
+	if (!captures) {
+		printf("Error allocating capture buffers\n");
+		return -1;
+	}
+
+	for (int i = 0; i < num_cpus; i++) {
+		if (tif_capture_init(&captures[i], nohz_cpus[i],
+					CAPTURE_SAMPLES)) {
+			printf("Error allocating locked capture buffer\n");
+			return -1;
+		}
+		td[i].cap = &captures[i];
+	}
+
+	if (tif_capture_start(captures, num_cpus)) {
+		printf("Error creating capture writer thread\n");
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * Finds the counters available by opening them for the main thread and
+ * allocates the counter breakdown of each CPU
+ *
+ * Returns 0 on success, -1 on error
+ */
+static int setup_pmu(void)
+{
+	struct tif_pmu p;
+	int n;
+
+	n = tif_pmu_open(&p);
+	for (int i = 0; i < PMU_EVENTS; i++)
+		pmu_avail[i] = p.pc[i] != NULL;
+	pmu_counters = n;
+	tif_pmu_close(&p);
+
+	//SMI count of every CPU, read by the main thread
+	smi_avail = 1;
+	for (int i = 0; i < num_cpus; i++)
+		if (tif_smi_open(&td[i].smi_count, nohz_cpus[i]))
+			smi_avail = 0;
+	if (!smi_avail)
+		close_smi();
+
+	if (!n && !smi_avail) {
+		printf("No hardware counters available\n");
+		return -1;
+	}
+
+	for (int i = 0; i < num_cpus; i++) {
+		td[i].loop_counts = calloc(PMU_BUCKETS,
+				sizeof(struct pmu_bucket));
+		if (!td[i].loop_counts) {
+			printf("Error allocating counter breakdown\n");
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+static int run_tests(void)
+{
+	return persistent ? run_persistent() : run_per_test();
+}
+
+static void teardown_workload(void)
+{
+	for (int i = 0; i < num_cpus; i++) {
+		if (td[i].wl_ready)
+			workload->teardown(td[i].wl_ctx);
+		td[i].wl_ready = 0;
+	}
+}
+
+/*
+ * Runs num_tests tests of the chase workload for each working set size
+ * doubling from SWEEP_MIN_SIZE to SWEEP_LLC_MULT times LLC size and
+ * prints a row of jitter and loop duration percentiles per size. With
+ * histogram enabled, histogram of each size is written to the file.
+ *
+ * Returns 0 on success, -1 on error
+ */
+static int run_sweep(void)
+{
+	size_t size, max_size = tif_workload_cache_size(0) * SWEEP_LLC_MULT;
+	char arg[32], name[32];
+
+	if (!max_size)
+		max_size = SWEEP_MAX_SIZE;
+
+	printf("                  (Jitter and loop time in nanoseconds)\n");
+	printf("  Size(KB) Max jitter  Mean jitter   Loop p50   Loop p99");
+	printf("   p99.9   Loop max\n");
+	printf("----------------------------------------------------------");
+	printf("-------------------\n");
+
+	for (size = SWEEP_MIN_SIZE; size <= max_size; size *= 2) {
+		snprintf(arg, sizeof(arg), "%zu", size);
+		workload_arg = arg;
+
+		tests_done = 0;
+		memset(&total_stats, 0, sizeof(total_stats));
+		for (int i = 0; i < num_cpus; i++) {
+			memset(&td[i].stats, 0, sizeof(td[i].stats));
+			tif_hist_reset(td[i].hist);
+		}
+
+		if (run_tests())
+			return -1;
+
+		//Next size needs a new buffer
+		teardown_workload();
+
+		merge_hist();
+		printf("%10zu %10lu %12lu %10lu %10lu %8lu %10lu\n",
+				size >> 10, total_stats.max,
+				total_stats.sum / total_stats.count,
+				tif_hist_percentile(&total_hist, 50),
+				tif_hist_percentile(&total_hist, 99),
+				tif_hist_percentile(&total_hist, 99.9),
+				total_hist.max);
+
+		if (hist_fd) {
+			snprintf(name, sizeof(name), "size %zu", size);
+			tif_hist_write(&total_hist, name, hist_fd);
+		}
+	}
+
+	workload_arg = NULL;
+
+	return 0;
 }
 
 int main(int argc, char **argv)
 {
-	pthread_t tid;
-	struct thread_data td;
+	size_t len = 0;
+	int o;
+
+	//Saved before getopt() reorders them
+	for (int i = 1; i < argc && len < sizeof(options); i++)
+		len += snprintf(options + len, sizeof(options) - len, "%s%s",
+				i > 1 ? " " : "", argv[i]);
+
+	tif_meta_read(&meta);
 
 	if (parse_args(argc, argv))
 		goto ext;
 
+	if (restore_state) {
+		if (tif_state_restore()) {
+			printf("Error restoring settings from %s%s\n",
+					tif_state_file(), errno == EBUSY ?
+					", in use by a running process" : "");
+			return -1;
+		}
+		return 0;
+	}
+
+	//With -T fixes are left applied for a later -R
+	if (audit) {
+		o = tif_preflight(nohz_cpus, num_cpus,
+				tune ? PREFLIGHT_APPLY_PERSIST : 0, stdout);
+		if (o < 0)
+			printf("Error auditing isolation environment\n");
+		else
+			printf("%d violations\n", o);
+		return o ? 1 : 0;
+	}
+
+	if (tif_tsc_init() && use_tsc) {
+		printf("Error calibrating TSC\n");
+		goto ext;
+	}
+
+	if (pmu && setup_pmu())
+		goto ext;
+
+	if (noise_threshold) {
+		noise_ticks = noise_threshold * tif_tsc.hz / 1000000000;
+		noise_window = (uint64_t)num_loops * tif_tsc.hz / 1000000;
+	}
+
+	if (period_hz) {
+		period_ticks = tif_tsc.hz / period_hz;
+		if (!period_ticks) {
+			printf("Cycle rate above TSC rate\n");
+			goto ext;
+		}
+	}
+
 #if PRINT_INFO
 	dump_opts();
 #endif
@@ -321,43 +2327,86 @@ int main(int argc, char **argv)
 	if (signal(SIGINT, signal_handler) == SIG_ERR)
 		printf("Error registering Ctrl-C handler\n");
 
-	if (nohz_enter()) {
-		printf("Error setting up NOHZ_FULL\n");
-		goto ext;
-	}
+	if (tif_state_restore_on_signal())
+		printf("Error registering settings restore handlers\n");
 
-	for (;;) {
-		if (duration) {
-			if (time_expired())
-				break;
-		} else {
-			if (tests_done >= num_tests)
-				break;
+	for (int i = 0; i < num_cpus; i++) {
+		td[i].hist = calloc(1, sizeof(struct tif_hist));
+		if (!td[i].hist) {
+			printf("Error allocating histogram\n");
+			goto ext;
 		}
+	}
 
-		td.cpu = nohz_cpu;
+	if (capture_file && setup_capture())
+		goto ext;
 
-		if (pthread_create(&tid, NULL, &rt_thread, &td)) {
-			printf("Error creating RT workload thread\n");
-			exit(EXIT_FAILURE);
+	for (int i = 0; pipeline && i < num_cpus - 1; i++) {
+		if (tif_ring_init(&pipe_rings[i], sizeof(struct pipe_token),
+					RING_SIZE)) {
+			printf("Error allocating pipeline ring\n");
+			goto ext;
 		}
+	}
 
-		pthread_join(tid, NULL);
-		if (td.ret == -1)
+	if (attrib) {
+		if (tif_attrib_open()) {
+			printf("Error opening interrupt counters\n");
 			goto ext;
+		}
+		for (int i = 0; i < num_cpus; i++) {
+			td[i].causes = calloc(ATTRIB_BUCKETS,
+					sizeof(struct attrib_bucket));
+			if (!td[i].causes) {
+				printf("Error allocating cause breakdown\n");
+				goto ext;
+			}
+		}
+	}
+
+	//Before creating RT threads so that their stacks are locked too
+	if (prefault_stack && tif_mem_lock()) {
+		printf("Error locking memory\n");
+		goto ext;
+	}
 
-		if (td.jitter > cmax)
-			cmax = td.jitter;
-		if (td.jitter < cmin)
-			cmin = td.jitter;
-		avg += td.jitter;
-		tests_done++;
-		print_jitter(td.jitter);
+	if (tune && tif_preflight(nohz_cpus, num_cpus, PREFLIGHT_APPLY,
+				stdout) > 0)
+		printf("Isolation environment violations left, see above\n\n");
 
-		if (hist_fd)
-			fprintf(hist_fd, "%10u %10lu\n", tests_done, td.jitter);
+	//Created after setup so that failed runs leave no result file
+	if (out_format) {
+		if (!out_file) {
+			snprintf(out_name, sizeof(out_name), "%s.%s", OUT_FILE,
+					out_format == OUT_JSON ? "json" : "csv");
+			out_file = out_name;
+		}
+		out_fd = fopen(out_file, "w");
+		if (!out_fd) {
+			printf("Failed creating output file\n");
+			goto ext;
+		}
 	}
 
+	/*
+	 * RT threads wait for the setting to take effect, overlapping the
+	 * wait with their creation, affinity and workload setup
+	 */
+	if (nohz_enter_async()) {
+		if (errno == EBUSY)
+			printf("Settings in %s are in use by a running process\n",
+					tif_state_file());
+		printf("Error setting up NOHZ_FULL\n");
+		goto ext;
+	}
+
+	if (sweep)
+		run_sweep();
+	else
+		run_tests();
+
+	teardown_workload();
+
 ext:
 	cleanup();
 
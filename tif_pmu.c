@@ -0,0 +1,202 @@
+//SPDX-License-Identifier: GPL-2.0-or-later
+/*
+ * Copyright (C) 2020 Intel Corporation
+ *
+ * Per-thread hardware performance counters and SMI count
+ *
+ */
+
+#define _GNU_SOURCE
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include "tif_pmu.h"
+
+#define MSR_SMI_COUNT 0x34
+#define MSR_PMU_TYPE "/sys/bus/event_source/devices/msr/type"
+#define MSR_PMU_SMI "/sys/bus/event_source/devices/msr/events/smi"
+
+const char * const tif_pmu_names[PMU_EVENTS] = {
+	[PMU_CYCLES] = "cycles",
+	[PMU_INSTRUCTIONS] = "instructions",
+	[PMU_LLC_MISSES] = "LLC-misses",
+	[PMU_DTLB_MISSES] = "dTLB-misses",
+};
+
+static const struct {
+	uint32_t type;
+	uint64_t config;
+} pmu_events[PMU_EVENTS] = {
+	[PMU_CYCLES] = { PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES },
+	[PMU_INSTRUCTIONS] = { PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS },
+	[PMU_LLC_MISSES] = { PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES },
+	[PMU_DTLB_MISSES] = { PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_DTLB |
+		(PERF_COUNT_HW_CACHE_OP_READ << 8) |
+		(PERF_COUNT_HW_CACHE_RESULT_MISS << 16) },
+};
+
+//Opens an event of the calling thread in any CPU, or of all tasks in cpu
+static int perf_open(struct perf_event_attr *attr, int cpu)
+{
+	return syscall(SYS_perf_event_open, attr, cpu < 0 ? 0 : -1, cpu, -1, 0);
+}
+
+/*
+ * Reads a number from a sysfs file, after '=' if there is one
+ *
+ * Returns 0 on success, -1 on error
+ */
+static int read_sysfs(const char *file, uint64_t *val)
+{
+	char buf[64], *p;
+	int fd, len;
+
+	fd = open(file, O_RDONLY);
+	if (fd < 0)
+		return -1;
+
+	len = read(fd, buf, sizeof(buf) - 1);
+	close(fd);
+	if (len <= 0)
+		return -1;
+	buf[len] = 0;
+
+	p = strchr(buf, '=');
+	*val = strtoull(p ? p + 1 : buf, NULL, 0);
+
+	return 0;
+}
+
+/*
+ * Opens a counter of the calling thread and maps its perf page. Kernel
+ * counts are included unless not permitted.
+ *
+ * Returns 0 on success, -1 if the counter cannot be read with rdpmc
+ */
+static int open_event(struct tif_pmu *p, int i)
+{
+	struct perf_event_attr attr;
+	struct perf_event_mmap_page *pc;
+
+	memset(&attr, 0, sizeof(attr));
+	attr.size = sizeof(attr);
+	attr.type = pmu_events[i].type;
+	attr.config = pmu_events[i].config;
+	attr.pinned = 1;
+	attr.exclude_hv = 1;
+
+	p->fd[i] = perf_open(&attr, -1);
+	if (p->fd[i] < 0 && (errno == EACCES || errno == EPERM)) {
+		attr.exclude_kernel = 1;
+		p->fd[i] = perf_open(&attr, -1);
+	}
+	if (p->fd[i] < 0)
+		return -1;
+
+	pc = mmap(NULL, sysconf(_SC_PAGESIZE), PROT_READ, MAP_SHARED,
+			p->fd[i], 0);
+	if (pc == MAP_FAILED)
+		return -1;
+	p->pc[i] = pc;
+
+	//Counter must be running in this CPU now and readable in user mode
+	if (!pc->cap_user_rdpmc || !pc->index) {
+		munmap(pc, sysconf(_SC_PAGESIZE));
+		p->pc[i] = NULL;
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * Opens the counters for the calling thread, which must be bound to the
+ * CPU it will be read in. Counters that are not supported or cannot be
+ * read with rdpmc are left unavailable with a NULL perf page.
+ *
+ * Returns number of counters available
+ */
+int tif_pmu_open(struct tif_pmu *p)
+{
+	int n = 0;
+
+	memset(p, 0, sizeof(*p));
+
+	for (int i = 0; i < PMU_EVENTS; i++)
+		if (!open_event(p, i))
+			n++;
+
+	return n;
+}
+
+void tif_pmu_close(struct tif_pmu *p)
+{
+	for (int i = 0; i < PMU_EVENTS; i++) {
+		if (p->pc[i])
+			munmap(p->pc[i], sysconf(_SC_PAGESIZE));
+		if (p->fd[i] >= 0)
+			close(p->fd[i]);
+		p->pc[i] = NULL;
+		p->fd[i] = -1;
+	}
+}
+
+/*
+ * Opens the SMI count of cpu from the msr perf PMU, falling back to the
+ * msr device. Can be opened and read from any thread.
+ *
+ * Returns 0 on success, -1 if the SMI count is not available
+ */
+int tif_smi_open(struct tif_smi *s, int cpu)
+{
+	struct perf_event_attr attr;
+	uint64_t type, config;
+	char file[64];
+
+	s->msr = 0;
+	if (!read_sysfs(MSR_PMU_TYPE, &type) &&
+			!read_sysfs(MSR_PMU_SMI, &config)) {
+		memset(&attr, 0, sizeof(attr));
+		attr.size = sizeof(attr);
+		attr.type = type;
+		attr.config = config;
+		s->fd = perf_open(&attr, cpu);
+		if (s->fd >= 0)
+			return 0;
+	}
+
+	snprintf(file, sizeof(file), "/dev/cpu/%d/msr", cpu);
+	s->fd = open(file, O_RDONLY);
+	s->msr = s->fd >= 0;
+
+	return s->fd >= 0 ? 0 : -1;
+}
+
+void tif_smi_close(struct tif_smi *s)
+{
+	if (s->fd >= 0)
+		close(s->fd);
+	s->fd = -1;
+}
+
+/*
+ * Reads the SMI count of the CPU. Makes a system call.
+ *
+ * Returns 0 on success, -1 on error
+ */
+int tif_smi_read(const struct tif_smi *s, uint64_t *count)
+{
+	if (s->fd < 0)
+		return -1;
+
+	if (s->msr)
+		return pread(s->fd, count, sizeof(*count),
+				MSR_SMI_COUNT) == sizeof(*count) ? 0 : -1;
+
+	return read(s->fd, count, sizeof(*count)) == sizeof(*count) ? 0 : -1;
+}
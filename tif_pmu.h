@@ -0,0 +1,98 @@
+//SPDX-License-Identifier: GPL-2.0-or-later
+/*
+ * Copyright (C) 2020 Intel Corporation
+ *
+ * Per-thread hardware performance counters read without system calls.
+ *
+ * Counters are opened with perf_event_open() for the calling thread and
+ * their perf pages are mapped so that the thread can read them with
+ * rdpmc from the measured loop. Counters are pinned so that they are
+ * never multiplexed out while the thread runs.
+ *
+ * The SMI count (MSR_SMI_COUNT) cannot be read with rdpmc. It is read
+ * with a system call, from a per-CPU msr perf PMU event or the msr device
+ * of the CPU, so it is read from another thread between tests and not
+ * by the measured thread.
+ *
+ */
+
+#ifndef _TIF_PMU_H
+#define _TIF_PMU_H
+
+#include <stdint.h>
+#include <x86intrin.h>
+#include <linux/perf_event.h>
+
+enum tif_pmu_event {
+	PMU_CYCLES,
+	PMU_INSTRUCTIONS,
+	PMU_LLC_MISSES,
+	PMU_DTLB_MISSES,
+	PMU_EVENTS
+};
+
+struct tif_pmu {
+	int fd[PMU_EVENTS];
+	struct perf_event_mmap_page *pc[PMU_EVENTS]; //NULL if not readable
+};
+
+//SMI count of a CPU
+struct tif_smi {
+	int fd;
+	int msr; //fd is the msr device, else an msr PMU event
+};
+
+struct tif_pmu_count {
+	uint64_t v[PMU_EVENTS];
+};
+
+extern const char * const tif_pmu_names[PMU_EVENTS];
+
+/*
+ * Reads a counter from its perf page. The page is updated by the kernel
+ * when the counter is scheduled in or out, so it is retried if the
+ * sequence changed while reading.
+ */
+static inline uint64_t tif_pmu_rdpmc(struct perf_event_mmap_page *pc)
+{
+	uint32_t seq, idx;
+	uint64_t count, pmc;
+	int shift;
+
+	do {
+		seq = pc->lock;
+		asm volatile ("":::"memory");
+
+		idx = pc->index;
+		count = pc->offset;
+		if (idx) {
+			shift = 64 - pc->pmc_width;
+			pmc = __rdpmc(idx - 1);
+			//Sign extend the counter width
+			count += (int64_t)(pmc << shift) >> shift;
+		}
+
+		asm volatile ("":::"memory");
+	} while (pc->lock != seq);
+
+	return count;
+}
+
+/*
+ * Reads all readable counters, others are left 0. Must not make system
+ * calls as it is called from the measured loop.
+ */
+static inline void tif_pmu_read(const struct tif_pmu *p,
+		struct tif_pmu_count *c)
+{
+	for (int i = 0; i < PMU_EVENTS; i++)
+		c->v[i] = p->pc[i] ? tif_pmu_rdpmc(p->pc[i]) : 0;
+}
+
+int tif_pmu_open(struct tif_pmu *p);
+void tif_pmu_close(struct tif_pmu *p);
+int tif_smi_open(struct tif_smi *s, int cpu);
+void tif_smi_close(struct tif_smi *s);
+int tif_smi_read(const struct tif_smi *s, uint64_t *count);
+
+#endif //#ifndef _TIF_PMU_H
@@ -0,0 +1,622 @@
+//SPDX-License-Identifier: GPL-2.0-or-later
+/*
+ * Copyright (C) 2020 Intel Corporation
+ *
+ * Preflight audit and tuning of the isolation environment of nohz CPUs
+ *
+ */
+
+#define _GNU_SOURCE
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <ctype.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <limits.h>
+#include <numa.h>
+#include "tif_helper.h"
+#include "tif_preflight.h"
+
+#define SYS_CPU "/sys/devices/system/cpu"
+#define WQ_CPUMASK "/sys/devices/virtual/workqueue/cpumask"
+#define THP "/sys/kernel/mm/transparent_hugepage"
+
+static char root[PATH_MAX / 2];
+
+//Kept open while C-states are limited
+static int dma_latency_fd = -1;
+
+struct preflight {
+	struct bitmask *cpus; //Audited CPUs
+	struct bitmask *hk; //Housekeeping CPUs, online CPUs not audited
+	char hk_list[256];
+	char hk_mask[256];
+	int apply;
+	FILE *fp;
+	int violations; //Not fixed
+};
+
+/*
+ * Returns 0 on success, -1 if path is too long
+ */
+static int root_path(char *buf, size_t size, const char *path)
+{
+	return snprintf(buf, size, "%s%s", root, path) < (int)size ? 0 : -1;
+}
+
+/*
+ * Sets the directory under which /proc, /sys and /dev are read and
+ * written. NULL or "" uses the real root. Original values of fixed
+ * settings are saved in TIF_STATE_FILE under the same directory, so it
+ * must be set before any fix is applied.
+ *
+ * Returns 0 on success, -1 on error
+ */
+int tif_preflight_set_root(const char *dir)
+{
+	char file[PATH_MAX];
+
+	snprintf(root, sizeof(root), "%s", dir ? dir : "");
+
+	if (!root[0])
+		return tif_state_set_file(NULL);
+
+	root_path(file, sizeof(file), TIF_STATE_FILE);
+
+	return tif_state_set_file(file);
+}
+
+/*
+ * Reads the first line of a file under root without the newline
+ *
+ * Returns 0 on success, -1 on error
+ */
+static int read_line(const char *path, char *val, int size)
+{
+	char file[PATH_MAX];
+	FILE *fp;
+	char *ptr;
+
+	root_path(file, sizeof(file), path);
+	fp = fopen(file, "rb");
+	if (!fp)
+		return -1;
+
+	ptr = fgets(val, size, fp);
+	fclose(fp);
+
+	if (!ptr)
+		return -1;
+
+	val[strcspn(val, "\n")] = 0;
+
+	return 0;
+}
+
+/*
+ * Reads a CPU list like "0,2-5" from the first line of a file under
+ * root. If prefix is set, the list is taken from the space separated
+ * word starting with prefix e.g. "rcu_nocbs=" in /proc/cmdline. CPUs are
+ * not limited to the possible CPUs of the host so that fake roots of
+ * larger systems can be audited.
+ *
+ * Returns allocated mask, empty if file or list is not found
+ */
+static struct bitmask *read_list(const char *path, const char *prefix)
+{
+	struct bitmask *mask = numa_bitmask_alloc(PREFLIGHT_MAX_CPUS);
+	char line[4096], *str, *end;
+	unsigned long first, last;
+
+	if (read_line(path, line, sizeof(line)))
+		return mask;
+
+	str = line;
+	if (prefix) {
+		str = strstr(line, prefix);
+		while (str && str != line && !isspace(str[-1]))
+			str = strstr(str + 1, prefix);
+		if (!str)
+			return mask;
+		str += strlen(prefix);
+	}
+
+	while (isdigit(*str)) {
+		first = last = strtoul(str, &end, 10);
+		if (*end == '-')
+			last = strtoul(end + 1, &end, 10);
+
+		for (; first <= last && first < PREFLIGHT_MAX_CPUS; first++)
+			numa_bitmask_setbit(mask, first);
+
+		if (*end != ',')
+			break;
+		str = end + 1;
+	}
+
+	return mask;
+}
+
+/*
+ * Reads a hex CPU mask like "ff,ffffffff"
+ *
+ * Returns allocated mask, NULL if file is not found
+ */
+static struct bitmask *read_hex_mask(const char *path)
+{
+	struct bitmask *mask;
+	char str[256];
+	unsigned int bit = 0;
+	int d;
+
+	if (read_line(path, str, sizeof(str)))
+		return NULL;
+
+	mask = numa_bitmask_alloc(PREFLIGHT_MAX_CPUS);
+
+	for (int i = strlen(str) - 1; i >= 0; i--) {
+		if (!isxdigit(str[i]))
+			continue;
+
+		d = isdigit(str[i]) ? str[i] - '0' : tolower(str[i]) - 'a' + 10;
+		for (int b = 0; b < 4; b++, bit++)
+			if (d & (1 << b) && bit < mask->size)
+				numa_bitmask_setbit(mask, bit);
+	}
+
+	return mask;
+}
+
+/*
+ * Formats mask as comma separated 32 bit hex words as written by the
+ * kernel
+ */
+static void format_hex_mask(struct bitmask *mask, char *buf, size_t size)
+{
+	int words = 1, len = 0;
+	uint32_t w;
+
+	for (unsigned int c = 0; c < mask->size; c++)
+		if (numa_bitmask_isbitset(mask, c))
+			words = c / 32 + 1;
+
+	buf[0] = 0;
+	for (int i = words - 1; i >= 0 && len < (int)size; i--) {
+		w = 0;
+		for (int b = 0; b < 32; b++)
+			if (numa_bitmask_isbitset(mask, i * 32 + b))
+				w |= 1U << b;
+		len += snprintf(buf + len, size - len, "%s%08x",
+				i == words - 1 ? "" : ",", w);
+	}
+}
+
+/*
+ * Formats mask as a CPU list like "0,2-5"
+ */
+static void format_cpu_list(struct bitmask *mask, char *buf, size_t size)
+{
+	unsigned int c, first;
+	int len = 0;
+
+	buf[0] = 0;
+	for (c = 0; c < mask->size && len < (int)size; c++) {
+		if (!numa_bitmask_isbitset(mask, c))
+			continue;
+
+		first = c;
+		while (c + 1 < mask->size && numa_bitmask_isbitset(mask, c + 1))
+			c++;
+
+		len += snprintf(buf + len, size - len, "%s%u", len ? "," : "",
+				first);
+		if (c > first)
+			len += snprintf(buf + len, size - len, "-%u", c);
+	}
+}
+
+//Returns 1 if any audited CPU is set in mask
+static int overlaps(struct preflight *pf, struct bitmask *mask)
+{
+	for (unsigned int c = 0; c < pf->cpus->size && c < mask->size; c++)
+		if (numa_bitmask_isbitset(pf->cpus, c) &&
+				numa_bitmask_isbitset(mask, c))
+			return 1;
+
+	return 0;
+}
+
+/*
+ * Saves the setting with tif_state_save() and writes val
+ *
+ * Returns 0 on success, -1 on error
+ */
+static int write_fix(const char *path, const char *val)
+{
+	char file[PATH_MAX];
+	FILE *fp;
+
+	root_path(file, sizeof(file), path);
+
+	if (tif_state_save(file))
+		return -1;
+
+	fp = fopen(file, "wb");
+	if (!fp)
+		return -1;
+
+	fputs(val, fp);
+
+	return fclose(fp) ? -1 : 0;
+}
+
+/*
+ * Reports a violation. If fix is set and fixes are being applied, fix is
+ * written to path.
+ */
+static void report(struct preflight *pf, const char *check, const char *impact,
+		const char *path, const char *fix, const char *fmt, ...)
+{
+	const char *status = "";
+	va_list ap;
+
+	if (pf->apply) {
+		status = " (not fixable)";
+		if (fix)
+			status = write_fix(path, fix) ? " (fix failed)" : " (fixed)";
+	}
+
+	if (strcmp(status, " (fixed)"))
+		pf->violations++;
+
+	fprintf(pf->fp, "%-12s", check);
+	va_start(ap, fmt);
+	vfprintf(pf->fp, fmt, ap);
+	va_end(ap);
+	fprintf(pf->fp, "%s\n%-12sImpact: %s\n", status, "", impact);
+}
+
+/*
+ * Boot parameters that can only be checked
+ */
+static void check_boot(struct preflight *pf)
+{
+	struct bitmask *mask, *nohz;
+
+	nohz = read_list(SYS_CPU "/nohz_full", NULL);
+	for (unsigned int c = 0; c < pf->cpus->size; c++)
+		if (numa_bitmask_isbitset(pf->cpus, c) &&
+				!numa_bitmask_isbitset(nohz, c))
+			report(pf, "nohz_full", "scheduler tick every 1-4ms on the CPU",
+					NULL, NULL, "CPU %u not in nohz_full boot parameter", c);
+
+	//The kernel offloads RCU callbacks of nohz_full CPUs too
+	mask = read_list("/proc/cmdline", "rcu_nocbs=");
+	for (unsigned int c = 0; c < pf->cpus->size; c++)
+		if (numa_bitmask_isbitset(pf->cpus, c) &&
+				!numa_bitmask_isbitset(mask, c) &&
+				!numa_bitmask_isbitset(nohz, c))
+			report(pf, "rcu", "RCU callbacks run in softirq on the CPU,"
+					" up to ms after grace periods", NULL, NULL,
+					"CPU %u not in rcu_nocbs or nohz_full boot"
+					" parameter", c);
+	numa_bitmask_free(mask);
+	numa_bitmask_free(nohz);
+
+	mask = read_list(SYS_CPU "/isolated", NULL);
+	for (unsigned int c = 0; c < pf->cpus->size; c++)
+		if (numa_bitmask_isbitset(pf->cpus, c) &&
+				!numa_bitmask_isbitset(mask, c))
+			report(pf, "isolcpus", "load balancing can move other tasks"
+					" to the CPU", NULL, NULL,
+					"CPU %u not in isolcpus boot parameter", c);
+	numa_bitmask_free(mask);
+}
+
+/*
+ * Affinity of every IRQ and of new IRQs
+ */
+static void check_irqs(struct preflight *pf)
+{
+	char path[PATH_MAX], list[256];
+	char irq[64];
+	struct bitmask *mask;
+	struct dirent *de;
+	DIR *dir;
+
+	mask = read_hex_mask("/proc/irq/default_smp_affinity");
+	if (mask && overlaps(pf, mask)) {
+		format_cpu_list(mask, list, sizeof(list));
+		report(pf, "irq", "new device interrupts run on the CPU,"
+				" 1-50us each", "/proc/irq/default_smp_affinity",
+				pf->hk_mask, "Default IRQ affinity %s includes nohz CPUs",
+				list);
+	}
+	numa_bitmask_free(mask);
+
+	root_path(path, sizeof(path), "/proc/irq");
+	dir = opendir(path);
+	if (!dir)
+		return;
+
+	while ((de = readdir(dir))) {
+		if (!isdigit(de->d_name[0]))
+			continue;
+
+		snprintf(irq, sizeof(irq), "/proc/irq/%.16s/smp_affinity_list",
+				de->d_name);
+		mask = read_list(irq, NULL);
+		if (overlaps(pf, mask)) {
+			format_cpu_list(mask, list, sizeof(list));
+			report(pf, "irq", "device interrupts run on the CPU,"
+					" 1-50us each", irq, pf->hk_list,
+					"IRQ %s affinity %s includes nohz CPUs",
+					de->d_name, list);
+		}
+		numa_bitmask_free(mask);
+	}
+
+	closedir(dir);
+}
+
+static void check_workqueue(struct preflight *pf)
+{
+	struct bitmask *mask;
+	char list[256];
+
+	mask = read_hex_mask(WQ_CPUMASK);
+	if (mask && overlaps(pf, mask)) {
+		format_cpu_list(mask, list, sizeof(list));
+		report(pf, "workqueue", "unbound kworkers run on the CPU,"
+				" 10us-ms per work item", WQ_CPUMASK, pf->hk_mask,
+				"Unbound workqueue cpumask %s includes nohz CPUs",
+				list);
+	}
+	numa_bitmask_free(mask);
+}
+
+/*
+ * Settings that should have a fixed value
+ */
+static void check_sysctls(struct preflight *pf)
+{
+	static const struct {
+		const char *check;
+		const char *path;
+		const char *val;
+		const char *impact;
+	} settings[] = {
+		{"timer", "/proc/sys/kernel/timer_migration", "0",
+			"timers of other CPUs can be queued on the CPU"},
+		{"thp", THP "/khugepaged/defrag", "0",
+			"khugepaged compaction of memory used by the CPU,"
+			" ms stalls"},
+		{"watchdog", "/proc/sys/kernel/nmi_watchdog", "0",
+			"NMI watchdog perf interrupt on the CPU every few"
+			" seconds, 5-20us"},
+	};
+	struct bitmask *mask;
+	char val[256], list[256];
+
+	for (unsigned int i = 0; i < sizeof(settings) / sizeof(settings[0]); i++) {
+		if (read_line(settings[i].path, val, sizeof(val)))
+			continue;
+
+		if (strcmp(val, settings[i].val))
+			report(pf, settings[i].check, settings[i].impact,
+					settings[i].path, settings[i].val,
+					"%s is %s, expected %s", settings[i].path,
+					val, settings[i].val);
+	}
+
+	if (!read_line(THP "/enabled", val, sizeof(val)) &&
+			strstr(val, "[always]"))
+		report(pf, "thp", "huge page faults and khugepaged scans,"
+				" ms stalls", THP "/enabled", "madvise",
+				"Transparent huge pages always enabled");
+
+	if (!read_line("/proc/sys/vm/stat_interval", val, sizeof(val)) &&
+			atoi(val) < PREFLIGHT_STAT_INTERVAL) {
+		snprintf(list, sizeof(list), "%d", PREFLIGHT_STAT_INTERVAL);
+		report(pf, "vmstat", "vmstat_update work on the CPU every"
+				" interval, 5-20us", "/proc/sys/vm/stat_interval",
+				list, "vm.stat_interval is %ss, expected %ds or more",
+				val, PREFLIGHT_STAT_INTERVAL);
+	}
+
+	mask = read_list("/proc/sys/kernel/watchdog_cpumask", NULL);
+	if (overlaps(pf, mask)) {
+		format_cpu_list(mask, list, sizeof(list));
+		report(pf, "watchdog", "soft lockup watchdog timer and thread"
+				" on the CPU", "/proc/sys/kernel/watchdog_cpumask",
+				pf->hk_list, "Watchdog cpumask %s includes nohz CPUs",
+				list);
+	}
+	numa_bitmask_free(mask);
+}
+
+/*
+ * Limits C-states of all CPUs to C0 through /dev/cpu_dma_latency. The
+ * limit is held while the file is open.
+ *
+ * Returns 0 on success, -1 on error
+ */
+static int limit_cstates(void)
+{
+	char file[PATH_MAX];
+	int32_t lat = 0;
+
+	if (dma_latency_fd >= 0)
+		return 0;
+
+	root_path(file, sizeof(file), "/dev/cpu_dma_latency");
+	dma_latency_fd = open(file, O_WRONLY);
+	if (dma_latency_fd < 0)
+		return -1;
+
+	if (write(dma_latency_fd, &lat, sizeof(lat)) != sizeof(lat)) {
+		close(dma_latency_fd);
+		dma_latency_fd = -1;
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * cpufreq governor and C-states of each CPU
+ */
+static void check_power(struct preflight *pf)
+{
+	char path[128], val[256], name[64];
+	int max_lat, lat;
+	const char *status;
+
+	for (unsigned int c = 0; c < pf->cpus->size; c++) {
+		if (!numa_bitmask_isbitset(pf->cpus, c))
+			continue;
+
+		snprintf(path, sizeof(path),
+				SYS_CPU "/cpu%u/cpufreq/scaling_governor", c);
+		if (!read_line(path, val, sizeof(val)) &&
+				strcmp(val, "performance"))
+			report(pf, "cpufreq", "frequency changes stall the CPU"
+					" 10-100us", path, "performance",
+					"CPU %u governor is %s, expected performance",
+					c, val);
+
+		//Deepest enabled C-state
+		max_lat = 0;
+		for (int s = 0; ; s++) {
+			snprintf(path, sizeof(path),
+					SYS_CPU "/cpu%u/cpuidle/state%d/latency", c, s);
+			if (read_line(path, val, sizeof(val)))
+				break;
+			lat = atoi(val);
+
+			snprintf(path, sizeof(path),
+					SYS_CPU "/cpu%u/cpuidle/state%d/disable", c, s);
+			if (!read_line(path, val, sizeof(val)) && atoi(val))
+				continue;
+
+			if (lat > max_lat) {
+				max_lat = lat;
+				snprintf(path, sizeof(path),
+						SYS_CPU "/cpu%u/cpuidle/state%d/name",
+						c, s);
+				if (read_line(path, name, sizeof(name)))
+					strcpy(name, "?");
+			}
+		}
+
+		if (!max_lat)
+			continue;
+
+		//Fixed by the /dev/cpu_dma_latency limit of all CPUs, which
+		//may be held from an earlier tif_preflight() and is released
+		//when the process exits
+		status = "";
+		if (pf->apply == PREFLIGHT_APPLY_PERSIST)
+			status = " (not fixed, only held while running)";
+		else if (pf->apply || dma_latency_fd >= 0)
+			status = limit_cstates() ? " (fix failed)" : " (fixed)";
+		if (strcmp(status, " (fixed)"))
+			pf->violations++;
+
+		fprintf(pf->fp, "%-12sCPU %u C-state %s with %dus exit latency"
+				" enabled%s\n%-12sImpact: wakeups of the CPU and its"
+				" SMT sibling take up to %dus\n", "cstate", c, name,
+				max_lat, status, "", max_lat);
+	}
+}
+
+/*
+ * Audits the isolation environment of the CPUs and reports violations to
+ * fp. If apply is set, violations that can be fixed at run time are
+ * fixed. Fixes are reverted by tif_preflight_revert() or nohz_exit().
+ * With PREFLIGHT_APPLY_PERSIST the C-state limit, which only lasts while
+ * the process runs, is reported as not fixed.
+ *
+ * Params:
+ * const int *cpus: CPUs to audit
+ * int num: number of CPUs, 0 to audit all nohz_full CPUs
+ * int apply: 0 to only audit, PREFLIGHT_APPLY or PREFLIGHT_APPLY_PERSIST
+ * FILE *fp: file to report violations to
+ *
+ * Returns number of violations not fixed, -1 on error
+ */
+int tif_preflight(const int *cpus, int num, int apply, FILE *fp)
+{
+	struct preflight pf;
+	struct bitmask *online;
+
+	memset(&pf, 0, sizeof(pf));
+	pf.apply = apply;
+	pf.fp = fp;
+
+	if (num) {
+		pf.cpus = numa_bitmask_alloc(PREFLIGHT_MAX_CPUS);
+		for (int i = 0; i < num; i++) {
+			if (cpus[i] < 0 || cpus[i] >= (int)pf.cpus->size) {
+				numa_bitmask_free(pf.cpus);
+				return -1;
+			}
+			numa_bitmask_setbit(pf.cpus, cpus[i]);
+		}
+	} else {
+		pf.cpus = read_list(SYS_CPU "/nohz_full", NULL);
+	}
+
+	if (!numa_bitmask_weight(pf.cpus)) {
+		fprintf(fp, "%-12sNo nohz_full CPUs\n", "nohz_full");
+		numa_bitmask_free(pf.cpus);
+		return 1;
+	}
+
+	//Fixes move work to the online CPUs not audited
+	online = read_list(SYS_CPU "/online", NULL);
+	pf.hk = numa_bitmask_alloc(PREFLIGHT_MAX_CPUS);
+	for (unsigned int c = 0; c < online->size; c++)
+		if (numa_bitmask_isbitset(online, c) &&
+				!numa_bitmask_isbitset(pf.cpus, c))
+			numa_bitmask_setbit(pf.hk, c);
+	numa_bitmask_free(online);
+
+	if (!numa_bitmask_weight(pf.hk)) {
+		fprintf(fp, "%-12sNo housekeeping CPUs left\n", "online");
+		pf.violations++;
+		pf.apply = 0;
+	}
+	format_cpu_list(pf.hk, pf.hk_list, sizeof(pf.hk_list));
+	format_hex_mask(pf.hk, pf.hk_mask, sizeof(pf.hk_mask));
+
+	check_boot(&pf);
+	check_irqs(&pf);
+	check_workqueue(&pf);
+	check_sysctls(&pf);
+	check_power(&pf);
+
+	numa_bitmask_free(pf.hk);
+	numa_bitmask_free(pf.cpus);
+
+	return pf.violations;
+}
+
+/*
+ * Reverts fixes applied by tif_preflight()
+ *
+ * Returns 0 on success, -1 on error
+ */
+int tif_preflight_revert(void)
+{
+	if (dma_latency_fd >= 0) {
+		close(dma_latency_fd);
+		dma_latency_fd = -1;
+	}
+
+	return tif_state_restore();
+}
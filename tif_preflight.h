@@ -0,0 +1,42 @@
+//SPDX-License-Identifier: GPL-2.0-or-later
+/*
+ * Copyright (C) 2020 Intel Corporation
+ *
+ * Preflight audit of the isolation environment of nohz CPUs
+ *
+ * Checks the kernel settings outside of TIF's control that cause jitter
+ * in the nohz CPUs: boot parameters, IRQ affinity, unbound workqueues,
+ * timer migration, transparent huge pages, vmstat interval, cpufreq
+ * governor, C-states and watchdogs. Every violation is reported with its
+ * expected jitter impact. Settings that can be changed at run time can
+ * optionally be fixed. Their original values are saved with
+ * tif_state_save() and restored by tif_preflight_revert() or
+ * nohz_exit().
+ *
+ * All files are read under a root directory which can be set to a fake
+ * /proc, /sys and /dev tree for testing. The state file of the saved
+ * values is kept under the same root.
+ *
+ */
+
+#ifndef _TIF_PREFLIGHT_H
+#define _TIF_PREFLIGHT_H
+
+#include <stdio.h>
+
+//Max CPUs of the audited system
+#define PREFLIGHT_MAX_CPUS 4096
+
+//Minimum vm.stat_interval in seconds
+#define PREFLIGHT_STAT_INTERVAL 10
+
+//tif_preflight() apply values: fix while the process runs, or fix and
+//leave the fixes after exit, which C-state limits can not be
+#define PREFLIGHT_APPLY 1
+#define PREFLIGHT_APPLY_PERSIST 2
+
+int tif_preflight_set_root(const char *dir);
+int tif_preflight(const int *cpus, int num, int apply, FILE *fp);
+int tif_preflight_revert(void);
+
+#endif //#ifndef _TIF_PREFLIGHT_H
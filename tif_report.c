@@ -0,0 +1,123 @@
+//SPDX-License-Identifier: GPL-2.0-or-later
+/*
+ * Copyright (C) 2020 Intel Corporation
+ *
+ * Run metadata and string quoting for machine readable results
+ *
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/utsname.h>
+#include "tif_report.h"
+
+/*
+ * Reads the first line of file into buf without the newline, empty if
+ * the file cannot be read
+ */
+static void read_line(const char *file, char *buf, size_t size)
+{
+	FILE *fp;
+
+	buf[0] = 0;
+	fp = fopen(file, "r");
+	if (!fp)
+		return;
+
+	if (!fgets(buf, size, fp))
+		buf[0] = 0;
+	buf[strcspn(buf, "\n")] = 0;
+	fclose(fp);
+}
+
+//Reads the model name of the first CPU from /proc/cpuinfo
+static void read_cpu_model(char *buf, size_t size)
+{
+	char line[512], *p;
+	FILE *fp;
+
+	buf[0] = 0;
+	fp = fopen("/proc/cpuinfo", "r");
+	if (!fp)
+		return;
+
+	while (fgets(line, sizeof(line), fp)) {
+		if (strncmp(line, "model name", 10))
+			continue;
+
+		p = strchr(line, ':');
+		if (p) {
+			p += strspn(p + 1, " \t") + 1;
+			p[strcspn(p, "\n")] = 0;
+			snprintf(buf, size, "%s", p);
+		}
+		break;
+	}
+
+	fclose(fp);
+}
+
+/*
+ * Reads metadata describing the host and kernel of the run
+ *
+ * Returns 0 on success, -1 on error
+ */
+int tif_meta_read(struct tif_meta *m)
+{
+	struct utsname u;
+	time_t now;
+
+	memset(m, 0, sizeof(*m));
+
+	if (uname(&u))
+		return -1;
+	snprintf(m->hostname, sizeof(m->hostname), "%s", u.nodename);
+	snprintf(m->kernel, sizeof(m->kernel), "%.100s %.150s", u.release,
+			u.version);
+
+	read_line("/proc/cmdline", m->cmdline, sizeof(m->cmdline));
+	read_line("/sys/devices/system/cpu/nohz_full", m->nohz_full,
+			sizeof(m->nohz_full));
+	//Kernels print "(null)" if list is empty
+	if (!strcmp(m->nohz_full, "(null)"))
+		m->nohz_full[0] = 0;
+	read_line("/sys/devices/system/cpu/isolated", m->isolcpus,
+			sizeof(m->isolcpus));
+	read_cpu_model(m->cpu_model, sizeof(m->cpu_model));
+
+	now = time(NULL);
+	strftime(m->time, sizeof(m->time), "%Y-%m-%dT%H:%M:%SZ",
+			gmtime(&now));
+
+	return 0;
+}
+
+//Writes s as a quoted JSON string
+void tif_json_str(FILE *fp, const char *s)
+{
+	fputc('"', fp);
+	for (; *s; s++) {
+		if (*s == '"' || *s == '\\')
+			fprintf(fp, "\\%c", *s);
+		else if ((unsigned char)*s < 0x20)
+			fprintf(fp, "\\u%04x", *s);
+		else
+			fputc(*s, fp);
+	}
+	fputc('"', fp);
+}
+
+//Writes s as a quoted CSV field
+void tif_csv_str(FILE *fp, const char *s)
+{
+	fputc('"', fp);
+	for (; *s; s++) {
+		if (*s == '"')
+			fputc('"', fp);
+		fputc(*s, fp);
+	}
+	fputc('"', fp);
+}
@@ -0,0 +1,29 @@
+//SPDX-License-Identifier: GPL-2.0-or-later
+/*
+ * Copyright (C) 2020 Intel Corporation
+ *
+ * Run metadata and string quoting for machine readable JSON and CSV
+ * results.
+ *
+ */
+
+#ifndef _TIF_REPORT_H
+#define _TIF_REPORT_H
+
+#include <stdio.h>
+
+struct tif_meta {
+	char hostname[256];
+	char kernel[256]; //Release and version
+	char cmdline[4096];
+	char nohz_full[256]; //CPU lists in effect, empty if none
+	char isolcpus[256];
+	char cpu_model[256];
+	char time[32]; //UTC start time in ISO 8601
+};
+
+int tif_meta_read(struct tif_meta *m);
+void tif_json_str(FILE *fp, const char *s);
+void tif_csv_str(FILE *fp, const char *s);
+
+#endif //#ifndef _TIF_REPORT_H
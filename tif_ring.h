@@ -0,0 +1,117 @@
+//SPDX-License-Identifier: GPL-2.0-or-later
+/*
+ * Copyright (C) 2020 Intel Corporation
+ *
+ * Lock-free single producer single consumer ring to pass data between
+ * RT threads and other threads without system calls.
+ *
+ * The producer and consumer indexes are kept in separate cache lines so
+ * that the two sides do not invalidate each other's cache lines except
+ * when they need to see the other side's progress.
+ *
+ */
+
+#ifndef _TIF_RING_H
+#define _TIF_RING_H
+
+#include <stdlib.h>
+#include <string.h>
+
+#define TIF_CACHE_LINE 64
+
+struct tif_ring {
+	//Written by producer only
+	unsigned long head __attribute__((aligned(TIF_CACHE_LINE)));
+	unsigned long tail_cache;
+
+	//Written by consumer only
+	unsigned long tail __attribute__((aligned(TIF_CACHE_LINE)));
+	unsigned long head_cache;
+
+	//Read only after init
+	char *buf __attribute__((aligned(TIF_CACHE_LINE)));
+	size_t elem_size;
+	unsigned long mask;
+};
+
+/*
+ * Initializes the ring to hold nelems elements of elem_size bytes.
+ * nelems must be a power of 2.
+ *
+ * Returns 0 on success, -1 on error
+ */
+static inline int tif_ring_init(struct tif_ring *r, size_t elem_size,
+		unsigned long nelems)
+{
+	size_t size;
+
+	if (!nelems || (nelems & (nelems - 1)))
+		return -1;
+
+	memset(r, 0, sizeof(*r));
+
+	//aligned_alloc() needs size to be a multiple of alignment
+	size = (elem_size * nelems + TIF_CACHE_LINE - 1) & ~(TIF_CACHE_LINE - 1);
+	r->buf = aligned_alloc(TIF_CACHE_LINE, size);
+	if (!r->buf)
+		return -1;
+
+	//Fault in the buffer before it is used by an RT thread
+	memset(r->buf, 0, size);
+
+	r->elem_size = elem_size;
+	r->mask = nelems - 1;
+
+	return 0;
+}
+
+static inline void tif_ring_free(struct tif_ring *r)
+{
+	free(r->buf);
+	r->buf = NULL;
+}
+
+/*
+ * Copies elem into the ring. Called only by the producer.
+ *
+ * Returns 0 on success, -1 if ring is full
+ */
+static inline int tif_ring_push(struct tif_ring *r, const void *elem)
+{
+	unsigned long head = r->head;
+
+	if (head - r->tail_cache > r->mask) {
+		r->tail_cache = __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE);
+		if (head - r->tail_cache > r->mask)
+			return -1;
+	}
+
+	memcpy(r->buf + (head & r->mask) * r->elem_size, elem, r->elem_size);
+	__atomic_store_n(&r->head, head + 1, __ATOMIC_RELEASE);
+
+	return 0;
+}
+
+/*
+ * Copies the oldest element in the ring to elem. Called only by the
+ * consumer.
+ *
+ * Returns 0 on success, -1 if ring is empty
+ */
+static inline int tif_ring_pop(struct tif_ring *r, void *elem)
+{
+	unsigned long tail = r->tail;
+
+	if (tail == r->head_cache) {
+		r->head_cache = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+		if (tail == r->head_cache)
+			return -1;
+	}
+
+	memcpy(elem, r->buf + (tail & r->mask) * r->elem_size, r->elem_size);
+	__atomic_store_n(&r->tail, tail + 1, __ATOMIC_RELEASE);
+
+	return 0;
+}
+
+#endif //#ifndef _TIF_RING_H
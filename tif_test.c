@@ -4,6 +4,10 @@
  *
  * Tests nohz state entry and measures time taken
  *
+ * With -n, leaves and re-enters nohz state repeatedly in the same
+ * process, measuring entry time with and without the 'forced' option of
+ * nohz_wait(), and reports entry time percentiles and failure rates.
+ *
  * Author: Ramesh Thomas
  * Created: 12/17/2020
  *
@@ -11,18 +15,196 @@
 
 #include <stdio.h>
 #include <stdlib.h>
-#include <time.h>
+#include <unistd.h>
 #include "tif_helper.h"
+#include "tif_hist.h"
 
 #define MAX_WAIT_US 15000000 
+#define TICK_CHECK_LOOPS 100 //Number of checks to average cost over
+#define REP_WAIT_US 1000000 //Max wait of each repeated entry
+#define REP_PRINT_NS 1000000000 //Progress print interval of repeated entries
+
+//Global options set by command line arguments
+long reps = -1; //Repeated entries, 0 = till an entry fails, -1 = single entry
+long rep_wait_us = REP_WAIT_US;
+FILE *hist_fd;
+
+//Entry times in ns and failures without and with 'forced'
+struct tif_hist entry_hist[2];
+uint64_t failures[2];
+
+/*
+ * Measures average time taken in nanoseconds by one tick stopped check
+ * using the given method
+ */
+static long tick_check_cost(int cpu, int method)
+{
+	uint64_t t1, t2;
+
+	t1 = tif_tsc_start();
+	for (int i = 0; i < TICK_CHECK_LOOPS; i++)
+		nohz_tick_stopped(cpu, method);
+	t2 = tif_tsc_stop();
+
+	return tif_tsc_to_ns(tif_tsc_elapsed(t1, t2)) / TICK_CHECK_LOOPS;
+}
+
+/*
+ * Moves the thread out of the nohz CPU and back so that it has to enter
+ * nohz state again, like toggle_affinity() does for forced entry
+ */
+static int leave_nohz(int cpu)
+{
+	if (set_cpu_affinity(0, 0) < 0 || set_cpu_affinity(cpu, 0) < 0)
+		return -1;
+
+	return 0;
+}
+
+//Prints a row of entry times and failure rate without and with 'forced'
+static void print_entries(long rep)
+{
+	printf("Rep# %ld\033[K\n", rep);
+	for (int f = 0; f < 2; f++)
+		printf("forced=%d failed %lu (%.3f%%) p50 %luus p99 %luus "
+				"p99.9 %luus max %luus\033[K\n", f, failures[f],
+				rep ? failures[f] * 100.0 / rep : 0,
+				tif_hist_percentile(&entry_hist[f], 50) / 1000,
+				tif_hist_percentile(&entry_hist[f], 99) / 1000,
+				tif_hist_percentile(&entry_hist[f], 99.9) / 1000,
+				entry_hist[f].max / 1000);
+}
+
+/*
+ * Leaves and enters nohz state reps times, or till an entry fails if
+ * reps is 0, first without and then with 'forced'. Entry times go to a
+ * histogram for each.
+ *
+ * Returns 0 on success, -1 on entry failure in stop on failure mode or
+ * on error
+ */
+static int repeat_entries(int cpu)
+{
+	uint64_t t1, t2, last = tif_tsc_start();
+	long rep, ret;
+
+	printf("\n");
+	for (rep = 1; !reps || rep <= reps; rep++) {
+		for (int f = 0; f < 2; f++) {
+			if (leave_nohz(cpu)) {
+				printf("Error moving thread out of CPU %d\n",
+						cpu);
+				return -1;
+			}
+
+			t1 = tif_tsc_start();
+			ret = nohz_wait(rep_wait_us, f);
+			t2 = tif_tsc_stop();
+
+			if (ret == -2) {
+				printf("NOHZ not supported\n");
+				return -1;
+			}
+
+			if (ret < 0) {
+				failures[f]++;
+			} else {
+				tif_hist_record(&entry_hist[f],
+						tif_tsc_to_ns(tif_tsc_elapsed(t1, t2)));
+			}
+
+			if (ret < 0 && !reps) {
+				print_entries(rep);
+				printf("Reproduced NOHZ_FULL failure with forced=%d "
+						"after %ld tries!!!\n", f, rep);
+				return -1;
+			}
+		}
+
+		//Printing makes system calls, next entry starts over anyway.
+		//Rows are updated in place.
+		if (tif_tsc_to_ns(tif_tsc_stop() - last) > REP_PRINT_NS) {
+			print_entries(rep);
+			printf("\033[3A");
+			last = tif_tsc_start();
+		}
+	}
+
+	print_entries(rep - 1);
+
+	if (hist_fd) {
+		tif_hist_write(&entry_hist[0], "forced 0", hist_fd);
+		tif_hist_write(&entry_hist[1], "forced 1", hist_fd);
+	}
+
+	return 0;
+}
+
+static void help(void)
+{
+	printf("\nUsage:\n\ntif_test [options]\n\n");
+	printf("-n <num>         Leave and enter nohz state num times in\n");
+	printf("                 process without and with forced entry,\n");
+	printf("                 0 = till an entry fails\n");
+	printf("-w <us>          Max wait of each repeated entry, default %d\n",
+			REP_WAIT_US);
+	printf("-H <file name>   Write entry time histograms in ns to file\n");
+	printf("\n");
+}
+
+static int parse_args(int argc, char **argv)
+{
+	int o;
+
+	while ((o = getopt(argc, argv, "n:w:H:")) != -1) {
+		switch (o) {
+		case 'n':
+			reps = atol(optarg);
+			if (reps < 0) {
+				printf("Invalid number of entries\n");
+				return -1;
+			}
+			break;
+		case 'w':
+			rep_wait_us = atol(optarg);
+			if (rep_wait_us <= 0) {
+				printf("Invalid wait\n");
+				return -1;
+			}
+			break;
+		case 'H':
+			hist_fd = fopen(optarg, "w");
+			if (!hist_fd) {
+				printf("Failed creating histogram file\n");
+				return -1;
+			}
+			break;
+		default:
+			help();
+			return -1;
+		}
+	}
+
+	return 0;
+}
 
 int main(int argc, char **argv)
 {
 	long ret, wait_us;
+	long fast_ns, full_ns;
+
+	uint64_t t1, t2;
+
+	if (parse_args(argc, argv))
+		exit(-1);
 
-	struct timespec t1, t2;
+	if (tif_tsc_init()) {
+		printf("Error calibrating TSC\n");
+		exit(-1);
+	}
 
-	if (nohz_enter()) {
+	//Wait for the setting to take effect after affinity setup
+	if (nohz_enter_async()) {
 		printf("Error setting up NOHZ_FULL\n");
 		goto ext;
 	}
@@ -39,20 +221,32 @@ int main(int argc, char **argv)
 		goto ext;
 	}
 
+	if (nohz_enter_wait()) {
+		printf("Error setting up NOHZ_FULL\n");
+		goto ext;
+	}
+
 	if (set_sched_fifo(0) < 0) {
 		printf("Error setting FIFO scheduling policy\n");
 		goto ext;
 	}
 
-	clock_gettime(CLOCK_MONOTONIC, &t1);
+	if (reps >= 0) {
+		ret = repeat_entries(nohz_cpu);
+		if (hist_fd)
+			fclose(hist_fd);
+		nohz_exit();
+		exit(ret ? -1 : 0);
+	}
+
+	t1 = tif_tsc_start();
 
 	/* Wait for MAX_WAIT_US without forcing nohz entry*/
 	ret = nohz_wait(MAX_WAIT_US, 0);
 
-	clock_gettime(CLOCK_MONOTONIC, &t2);
+	t2 = tif_tsc_stop();
 
-	wait_us = (t2.tv_sec * 1000000L + t2.tv_nsec / 1000L) -
-		       (t1.tv_sec * 1000000L + t1.tv_nsec / 1000L);
+	wait_us = tif_tsc_to_ns(tif_tsc_elapsed(t1, t2)) / 1000;
 	if (ret < 0) {
 		printf("\n\nError entering nohz state after %luus\n", wait_us);
 		nohz_exit();
@@ -61,6 +255,11 @@ int main(int argc, char **argv)
 
 	printf("Successfully entered nohz state in %luus%10s\n", wait_us, "");
 
+	fast_ns = tick_check_cost(nohz_cpu, TICK_CHECK_FAST);
+	full_ns = tick_check_cost(nohz_cpu, TICK_CHECK_FULL);
+	printf("Tick stopped check: %ldns, full timer_list parse: %ldns (%.1fx)\n",
+			fast_ns, full_ns, fast_ns ? (double)full_ns / fast_ns : 0);
+
 ext:
 	nohz_exit();
 	return 0;
@@ -2,44 +2,571 @@
 /*
  * Copyright (C) 2020 Intel Corporation
  *
- * Contains the tif_workload function called by tif_jitter
+ * Contains the workloads run by tif_jitter
  *
  * Author: Ramesh Thomas
  * Created: 5/11/2020
  *
  */
 
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
-#include <time.h>
+#include <stdint.h>
+#include <string.h>
+#include <sched.h>
+#include <dlfcn.h>
+#include <immintrin.h>
+#include "tif_helper.h"
+#include "tif_workload.h"
 
 #define WORKLOAD_LOOPS 50000 //Loops in workload
-#define WORK_MEM_SIZE 256
+#define WORK_MEM_SIZE 256 //Must be a power of 2
+#define RAND_BATCH 64 //Random indexes generated at a time by randv
 
-static inline unsigned int random_num(void)
+#define STREAM_SIZE (1 << 20) //Default bytes per stream array
+#define CHASE_STEPS 16384 //Dependent loads per pointer chase run
+#define FP_SIZE 1024 //Floats per FP array, fits in L1
+#define FP_LOOPS 1024 //Passes over the FP arrays per run
+#define CACHE_LINE 64
+
+//Back workload buffers with huge pages
+static int huge_pages;
+
+/*
+ * Parses size with optional K, M or G suffix
+ *
+ * Returns size in bytes, 0 on error
+ */
+static size_t parse_size(const char *str)
+{
+	char *end;
+	size_t size = strtoul(str, &end, 0);
+
+	switch (*end) {
+	case 'G':
+	case 'g':
+		size <<= 10;
+		/* fall through */
+	case 'M':
+	case 'm':
+		size <<= 10;
+		/* fall through */
+	case 'K':
+	case 'k':
+		size <<= 10;
+		end++;
+		break;
+	}
+
+	return *end ? 0 : size;
+}
+
+/*
+ * Returns size in bytes of the data cache of given level of the current
+ * CPU. Level 0 returns the last level cache. Returns 0 if not found.
+ */
+size_t tif_workload_cache_size(int level)
 {
-	unsigned int x;
+	char path[128], type[32];
+	int cpu = sched_getcpu();
+	int l, max_level = 0;
+	size_t size = 0, s;
+	FILE *fp;
+
+	for (int i = 0; ; i++) {
+		snprintf(path, sizeof(path),
+				"/sys/devices/system/cpu/cpu%d/cache/index%d/level",
+				cpu, i);
+		fp = fopen(path, "rb");
+		if (!fp)
+			break;
+		if (fscanf(fp, "%d", &l) != 1)
+			l = 0;
+		fclose(fp);
+
+		snprintf(path, sizeof(path),
+				"/sys/devices/system/cpu/cpu%d/cache/index%d/type",
+				cpu, i);
+		fp = fopen(path, "rb");
+		if (!fp)
+			break;
+		if (fscanf(fp, "%31s", type) != 1)
+			*type = 0;
+		fclose(fp);
+
+		if (!strcmp(type, "Instruction"))
+			continue;
+
+		snprintf(path, sizeof(path),
+				"/sys/devices/system/cpu/cpu%d/cache/index%d/size",
+				cpu, i);
+		fp = fopen(path, "rb");
+		if (!fp)
+			break;
+		if (fscanf(fp, "%31s", type) != 1)
+			*type = 0;
+		fclose(fp);
+
+		s = parse_size(type);
+		if ((level && l == level) || (!level && l > max_level)) {
+			size = s;
+			max_level = l;
+		}
+	}
+
+	return size;
+}
+
+/*******************************************************************
+ * rand - random reads and writes to a small buffer that stays in L1
+ *
+ * Indexes come from xorshift generators seeded once at init so that
+ * the loop measures memory and pipeline jitter instead of the cost of
+ * reading the TSC. randv generates indexes in batches with 8 generators
+ * in a vector.
+ ******************************************************************/
+typedef uint32_t v8u __attribute__((vector_size(32)));
 
-	asm volatile ("rdtsc" : "=a" (x));
+struct rand_ctx {
+	unsigned int a[WORK_MEM_SIZE];
+	uint32_t seed;
+	v8u seeds;
+	unsigned int idx[RAND_BATCH] __attribute__((aligned(32)));
+};
+
+static inline uint32_t xorshift32(uint32_t x)
+{
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
 
 	return x;
 }
 
-void nohz_workload(void)
+/*
+ * Fills idx with RAND_BATCH indexes into the work buffer
+ */
+static inline void rand_batch(v8u *seeds, unsigned int *idx)
+{
+	v8u x = *seeds;
+
+	for (int i = 0; i < RAND_BATCH; i += 8) {
+		x ^= x << 13;
+		x ^= x >> 17;
+		x ^= x << 5;
+		memcpy(&idx[i], &x, sizeof(x));
+	}
+
+	*seeds = x;
+
+	for (int i = 0; i < RAND_BATCH; i++)
+		idx[i] %= WORK_MEM_SIZE;
+}
+
+static int rand_init(void **ctx, const char *arg)
+{
+	struct rand_ctx *r = aligned_alloc(CACHE_LINE, sizeof(*r));
+	uint32_t seed;
+
+	if (!r)
+		return -1;
+
+	memset(r, 0, sizeof(*r));
+
+	//Seeds must be non zero for xorshift
+	seed = __rdtsc() | 1;
+	r->seed = seed;
+	for (int i = 0; i < 8; i++) {
+		seed = xorshift32(seed);
+		r->seeds[i] = seed;
+	}
+
+	*ctx = r;
+
+	return 0;
+}
+
+static void rand_run(void *ctx)
 {
-	static unsigned int a[WORK_MEM_SIZE];
+	struct rand_ctx *r = ctx;
+	unsigned int *a = r->a;
 	unsigned int i, x, y;
+	uint32_t seed = r->seed;
 
 	for (i = 0; i < WORKLOAD_LOOPS / 2; i++) {
-		x = random_num() % WORK_MEM_SIZE;
+		seed = xorshift32(seed);
+		x = seed % WORK_MEM_SIZE;
 		a[x] = x + 1;
-		y = random_num() % WORK_MEM_SIZE;
+		seed = xorshift32(seed);
+		y = seed % WORK_MEM_SIZE;
 		a[y] = x + y;
 	}
 	for (i = 0; i < WORKLOAD_LOOPS / 2; i++) {
-		x = a[random_num() % WORK_MEM_SIZE];
-		y = a[random_num() % WORK_MEM_SIZE];
+		seed = xorshift32(seed);
+		x = a[seed % WORK_MEM_SIZE];
+		seed = xorshift32(seed);
+		y = a[seed % WORK_MEM_SIZE];
 		x += y;
 		a[x % WORK_MEM_SIZE] = x;
 	}
+
+	r->seed = seed;
+}
+
+static void randv_run(void *ctx)
+{
+	struct rand_ctx *r = ctx;
+	unsigned int *a = r->a, *idx = r->idx;
+	unsigned int i, j, x, y;
+
+	for (i = 0; i < WORKLOAD_LOOPS / 2; i += RAND_BATCH / 2) {
+		rand_batch(&r->seeds, idx);
+		for (j = 0; j < RAND_BATCH; j += 2) {
+			x = idx[j];
+			a[x] = x + 1;
+			y = idx[j + 1];
+			a[y] = x + y;
+		}
+	}
+	for (i = 0; i < WORKLOAD_LOOPS / 2; i += RAND_BATCH / 2) {
+		rand_batch(&r->seeds, idx);
+		for (j = 0; j < RAND_BATCH; j += 2) {
+			x = a[idx[j]];
+			y = a[idx[j + 1]];
+			x += y;
+			a[x % WORK_MEM_SIZE] = x;
+		}
+	}
+}
+
+static void free_teardown(void *ctx)
+{
+	free(ctx);
+}
+
+/*******************************************************************
+ * stream - memory bandwidth bound triad over three arrays
+ ******************************************************************/
+struct stream_ctx {
+	size_t n;
+	double *a, *b, *c;
+};
+
+static int stream_init(void **ctx, const char *arg)
+{
+	size_t size = arg ? parse_size(arg) : STREAM_SIZE;
+	struct stream_ctx *s;
+
+	if (size < sizeof(double))
+		return -1;
+
+	s = calloc(1, sizeof(*s));
+	if (!s)
+		return -1;
+
+	s->n = size / sizeof(double);
+	s->a = tif_mem_alloc(s->n * sizeof(double) * 3, huge_pages);
+	if (!s->a) {
+		free(s);
+		return -1;
+	}
+	s->b = s->a + s->n;
+	s->c = s->b + s->n;
+
+	for (size_t i = 0; i < s->n; i++) {
+		s->a[i] = 0;
+		s->b[i] = i;
+		s->c[i] = 2 * i;
+	}
+
+	*ctx = s;
+
+	return 0;
+}
+
+static void stream_run(void *ctx)
+{
+	struct stream_ctx *s = ctx;
+
+	for (size_t i = 0; i < s->n; i++)
+		s->a[i] = s->b[i] + 3.0 * s->c[i];
+
+	asm volatile ("" : : "r" (s->a) : "memory");
+}
+
+static void stream_teardown(void *ctx)
+{
+	struct stream_ctx *s = ctx;
+
+	tif_mem_free(s->a, s->n * sizeof(double) * 3, huge_pages);
+	free(s);
+}
+
+/*******************************************************************
+ * chase - dependent loads following a random cycle through a buffer
+ ******************************************************************/
+struct chase_ctx {
+	void **buf;
+	void **p;
+	size_t size;
+};
+
+static void chase_teardown(void *ctx)
+{
+	struct chase_ctx *c = ctx;
+
+	tif_mem_free(c->buf, c->size, huge_pages);
+	free(c);
+}
+
+/*
+ * Size can be given in bytes or as l1, l2 or llc to use half the size
+ * of that cache of the CPU. The buffer is allocated in the NUMA node of
+ * the CPU as init runs in it. Every cache line is visited once per cycle
+ * in random order so that hardware prefetchers cannot predict the next
+ * line.
+ */
+static int chase_init(void **ctx, const char *arg)
+{
+	size_t size = 0, lines, stride = CACHE_LINE / sizeof(void *);
+	size_t *perm, i, j, t;
+	struct chase_ctx *c;
+	uint32_t seed;
+
+	if (!arg || !strcmp(arg, "l2"))
+		size = tif_workload_cache_size(2) / 2;
+	else if (!strcmp(arg, "l1"))
+		size = tif_workload_cache_size(1) / 2;
+	else if (!strcmp(arg, "llc"))
+		size = tif_workload_cache_size(0) / 2;
+	else
+		size = parse_size(arg);
+
+	lines = size / CACHE_LINE;
+	if (lines < 2)
+		return -1;
+
+	c = calloc(1, sizeof(*c));
+	if (!c)
+		return -1;
+
+	//Page aligned so each entry is at the start of a cache line
+	c->size = lines * CACHE_LINE;
+	c->buf = tif_mem_alloc(c->size, huge_pages);
+	perm = malloc(lines * sizeof(size_t));
+	if (!c->buf || !perm) {
+		free(perm);
+		chase_teardown(c);
+		return -1;
+	}
+
+	//Sattolo's algorithm gives a single cycle through all lines
+	//init runs in all CPUs at once, so each seeds its own generator
+	for (i = 0; i < lines; i++)
+		perm[i] = i;
+	seed = (__rdtsc() ^ ((uint32_t)sched_getcpu() * 2654435761U)) | 1;
+	for (i = lines - 1; i > 0; i--) {
+		seed = xorshift32(seed);
+		j = seed % i;
+		t = perm[i];
+		perm[i] = perm[j];
+		perm[j] = t;
+	}
+
+	for (i = 0; i < lines; i++)
+		c->buf[i * stride] = &c->buf[perm[i] * stride];
+
+	free(perm);
+
+	c->p = c->buf;
+	*ctx = c;
+
+	return 0;
+}
+
+static void chase_run(void *ctx)
+{
+	struct chase_ctx *c = ctx;
+	void **p = c->p;
+
+	for (int i = 0; i < CHASE_STEPS; i++)
+		p = *p;
+
+	//Continue from here next time to cover the whole buffer
+	c->p = p;
+}
+
+/*******************************************************************
+ * fp - dense floating point multiply-add loop in L1
+ ******************************************************************/
+struct fp_ctx {
+	float a[FP_SIZE] __attribute__((aligned(CACHE_LINE)));
+	float b[FP_SIZE] __attribute__((aligned(CACHE_LINE)));
+	float c[FP_SIZE] __attribute__((aligned(CACHE_LINE)));
+	int avx;
+};
+
+static int fp_init(void **ctx, const char *arg)
+{
+	struct fp_ctx *f = aligned_alloc(CACHE_LINE, sizeof(*f));
+
+	if (!f)
+		return -1;
+
+	for (int i = 0; i < FP_SIZE; i++) {
+		f->a[i] = 0;
+		f->b[i] = 1.0f / (i + 1);
+		f->c[i] = 0.999f;
+	}
+
+	f->avx = __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma");
+	*ctx = f;
+
+	return 0;
+}
+
+__attribute__((target("avx2,fma")))
+static void fp_run_avx(struct fp_ctx *f)
+{
+	for (int l = 0; l < FP_LOOPS; l++) {
+		for (int i = 0; i < FP_SIZE; i += 8) {
+			__m256 a = _mm256_load_ps(&f->a[i]);
+			__m256 b = _mm256_load_ps(&f->b[i]);
+			__m256 c = _mm256_load_ps(&f->c[i]);
+
+			_mm256_store_ps(&f->a[i], _mm256_fmadd_ps(a, c, b));
+		}
+	}
+}
+
+static void fp_run(void *ctx)
+{
+	struct fp_ctx *f = ctx;
+
+	if (f->avx) {
+		fp_run_avx(f);
+		return;
+	}
+
+	for (int l = 0; l < FP_LOOPS; l++)
+		for (int i = 0; i < FP_SIZE; i++)
+			f->a[i] = f->a[i] * f->c[i] + f->b[i];
+}
+
+/*******************************************************************
+ * dl - workload loaded from a shared object
+ ******************************************************************/
+struct dl_ctx {
+	void *handle;
+	void *ctx;
+	void (*run)(void *ctx);
+	void (*teardown)(void *ctx);
+};
+
+static int dl_init(void **ctx, const char *arg)
+{
+	int (*init)(void **ctx, const char *arg);
+	char path[4096], *sep;
+	struct dl_ctx *d;
+
+	if (!arg)
+		return -1;
+
+	snprintf(path, sizeof(path), "%s", arg);
+	sep = strchr(path, ':');
+	if (sep)
+		*sep++ = 0;
+
+	d = calloc(1, sizeof(*d));
+	if (!d)
+		return -1;
+
+	d->handle = dlopen(path, RTLD_NOW | RTLD_LOCAL);
+	if (!d->handle) {
+		printf("%s\n", dlerror());
+		goto err;
+	}
+
+	d->run = dlsym(d->handle, "tif_workload_run");
+	if (!d->run) {
+		printf("tif_workload_run not found in %s\n", path);
+		goto err;
+	}
+
+	d->teardown = dlsym(d->handle, "tif_workload_teardown");
+	init = dlsym(d->handle, "tif_workload_init");
+	if (init && init(&d->ctx, sep))
+		goto err;
+
+	*ctx = d;
+
+	return 0;
+
+err:
+	if (d->handle)
+		dlclose(d->handle);
+	free(d);
+
+	return -1;
+}
+
+static void dl_run(void *ctx)
+{
+	struct dl_ctx *d = ctx;
+
+	d->run(d->ctx);
+}
+
+static void dl_teardown(void *ctx)
+{
+	struct dl_ctx *d = ctx;
+
+	if (d->teardown)
+		d->teardown(d->ctx);
+	dlclose(d->handle);
+	free(d);
+}
+
+static const struct tif_workload workloads[] = {
+	{ "rand", "Random reads and writes to a 1KB buffer",
+		rand_init, rand_run, free_teardown },
+	{ "randv", "rand with vectorized index generation",
+		rand_init, randv_run, free_teardown },
+	{ "stream", "Memory bandwidth triad [:<bytes per array>]",
+		stream_init, stream_run, stream_teardown },
+	{ "chase", "Pointer chase [:l1|l2|llc|<bytes>]",
+		chase_init, chase_run, chase_teardown },
+	{ "fp", "Dense FP multiply-add, AVX2 if supported",
+		fp_init, fp_run, free_teardown },
+	{ "dl", "Workload in shared object :<path>[:<arg>]",
+		dl_init, dl_run, dl_teardown },
+};
+
+/*
+ * Sets whether buffers of workloads allocated after this call are backed
+ * with huge pages. Buffers are always pre-faulted and locked.
+ */
+void tif_workload_huge_pages(int enable)
+{
+	huge_pages = enable;
+}
+
+/*
+ * Returns workload with given name, NULL if not found
+ */
+const struct tif_workload *tif_workload_find(const char *name)
+{
+	for (size_t i = 0; i < sizeof(workloads) / sizeof(workloads[0]); i++)
+		if (!strcmp(workloads[i].name, name))
+			return &workloads[i];
+
+	return NULL;
+}
+
+void tif_workload_list(FILE *fp)
+{
+	for (size_t i = 0; i < sizeof(workloads) / sizeof(workloads[0]); i++)
+		fprintf(fp, "                 %-7s %s\n", workloads[i].name,
+				workloads[i].desc);
 }
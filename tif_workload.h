@@ -0,0 +1,42 @@
+//SPDX-License-Identifier: GPL-2.0-or-later
+/*
+ * Copyright (C) 2020 Intel Corporation
+ *
+ * Workloads run by tif_jitter in the NOHZ CPUs
+ *
+ * A workload is selected by name with an optional argument separated by
+ * ':' e.g. "chase:llc". init is called once per RT thread in its CPU
+ * before nohz entry and can allocate memory and make system calls. run
+ * is called in the measured loop and must not make system calls.
+ * teardown is called at exit by the main thread.
+ *
+ * Workloads can also be loaded from a shared object with "dl:<path>".
+ * The shared object must export tif_workload_run() and can optionally
+ * export tif_workload_init() and tif_workload_teardown() with the same
+ * signatures as the callbacks below. Text after a second ':' is passed
+ * as argument to its init e.g. "dl:./libctrl.so:gain=4".
+ *
+ */
+
+#ifndef _TIF_WORKLOAD_H
+#define _TIF_WORKLOAD_H
+
+#include <stdio.h>
+#include <stddef.h>
+
+#define DEFAULT_WORKLOAD "rand"
+
+struct tif_workload {
+	const char *name;
+	const char *desc;
+	int (*init)(void **ctx, const char *arg); //Returns 0 on success
+	void (*run)(void *ctx);
+	void (*teardown)(void *ctx);
+};
+
+const struct tif_workload *tif_workload_find(const char *name);
+void tif_workload_list(FILE *fp);
+size_t tif_workload_cache_size(int level);
+void tif_workload_huge_pages(int enable);
+
+#endif //#ifndef _TIF_WORKLOAD_H